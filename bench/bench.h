@@ -0,0 +1,78 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Shared bits of the benchmarks. Each one is a single translation unit linked against
+   the static library with `-Wl,--wrap=malloc,...` (see the Makefile), which makes every
+   allocation done by cno go through the counting wrappers below. */
+
+void *__real_malloc  (size_t);
+void *__real_calloc  (size_t, size_t);
+void *__real_realloc (void *, size_t);
+
+static struct
+{
+    size_t count;
+    size_t bytes;
+} bench_allocs;
+
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocs.count++;
+    bench_allocs.bytes += size;
+    return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    bench_allocs.count++;
+    bench_allocs.bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs.count++;
+    bench_allocs.bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+
+static inline double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* Scale the iteration counts with BENCH_SCALE (default 1) for quick or long runs. */
+static inline double bench_scale(void)
+{
+    const char *s = getenv("BENCH_SCALE");
+    double x = s ? atof(s) : 1;
+    return x > 0 ? x : 1;
+}
+
+
+/* Label the allocations made by cno from now on; see CNO_ALLOC_ACCOUNTING. */
+static inline const char *bench_context(const char *label)
+{
+#if CNO_ALLOC_ACCOUNTING
+    return cno_alloc_set_context(label);
+#else
+    return label;
+#endif
+}
+
+
+static inline void bench_alloc_stats_reset(void)
+{
+#if CNO_ALLOC_ACCOUNTING
+    cno_alloc_stats_reset();
+#endif
+}
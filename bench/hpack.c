@@ -0,0 +1,276 @@
+/* HPACK encoder and decoder throughput on a few synthetic but realistic header corpora,
+ * for several dynamic table sizes.
+ *
+ *     make bench
+ *     BENCH_SCALE=0.1 obj/bench-hpack [corpus-name-prefix]
+ *
+ * Throughput is measured in plain (uncompressed) bytes: total length of names and values.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../cno/hpack.h"
+#include "bench.h"
+
+#define BENCH_MESSAGES    2000
+#define BENCH_MAX_HEADERS 32
+
+
+struct bench_message_t
+{
+    size_t count;
+    struct cno_header_t headers[BENCH_MAX_HEADERS];
+};
+
+
+struct bench_corpus_t
+{
+    const char *name;
+    void (*generate)(struct bench_message_t *, size_t i);
+};
+
+
+static const uint32_t BENCH_TABLE_SIZES[] = { 0, 4096, 16384, 65536 };
+
+/* all generated strings live here so that the timed loops don't allocate anything */
+static char   BENCH_POOL[16 * 1024 * 1024];
+static size_t BENCH_POOL_SIZE;
+static uint64_t BENCH_RNG;
+
+
+static uint64_t bench_random(void)
+{
+    BENCH_RNG ^= BENCH_RNG << 13;
+    BENCH_RNG ^= BENCH_RNG >> 7;
+    BENCH_RNG ^= BENCH_RNG << 17;
+    return BENCH_RNG;
+}
+
+
+static struct cno_buffer_t bench_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static struct cno_buffer_t bench_printf(const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    char *out = BENCH_POOL + BENCH_POOL_SIZE;
+    int size = vsnprintf(out, sizeof(BENCH_POOL) - BENCH_POOL_SIZE, fmt, vl);
+    va_end(vl);
+    if (size < 0 || BENCH_POOL_SIZE + size >= sizeof(BENCH_POOL)) {
+        fprintf(stderr, "string pool exhausted\n");
+        abort();
+    }
+    BENCH_POOL_SIZE += size;
+    return (struct cno_buffer_t) { out, size };
+}
+
+
+static void bench_add(struct bench_message_t *m, const char *name, struct cno_buffer_t value)
+{
+    m->headers[m->count++] = (struct cno_header_t) { { name, strlen(name) }, value, 0, 0 };
+}
+
+
+#define bench_add_str(m, name, value) bench_add(m, name, CNO_BUFFER_STRING(value))
+#define bench_pick(...) ((const char *[]) { __VA_ARGS__ })[bench_random() % (sizeof((const char *[]) { __VA_ARGS__ }) / sizeof(const char *))]
+
+
+/* page loads: one navigation followed by subresources, a few sites interleaved */
+static void bench_browser(struct bench_message_t *m, size_t i)
+{
+    const char *site = bench_pick("www.example.com", "news.example.org", "shop.example.net");
+    const char *kind = i % 8 ? bench_pick("js", "css", "png", "woff2") : "html";
+    bench_add_str(m, ":method", "GET");
+    bench_add_str(m, ":scheme", "https");
+    bench_add(m, ":authority", bench_printf("%s", site));
+    bench_add(m, ":path", bench_printf("/assets/%08x.%s", (uint32_t) bench_random(), kind));
+    bench_add_str(m, "user-agent", "Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0");
+    bench_add(m, "accept", bench_printf("%s", !strcmp(kind, "html")
+        ? "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8"
+        : !strcmp(kind, "css") ? "text/css,*/*;q=0.1" : "*/*"));
+    bench_add_str(m, "accept-language", "en-US,en;q=0.5");
+    bench_add_str(m, "accept-encoding", "gzip, deflate, br");
+    bench_add(m, "referer", bench_printf("https://%s/", site));
+    bench_add(m, "sec-fetch-dest", bench_printf("%s", !strcmp(kind, "html") ? "document" : !strcmp(kind, "js") ? "script" : "style"));
+    bench_add_str(m, "sec-fetch-mode", "no-cors");
+    bench_add_str(m, "sec-fetch-site", "same-origin");
+    bench_add(m, "cookie", bench_printf("_ga=GA1.2.%u.1700000000; sid=%016llx", (uint32_t) (i / 50), (unsigned long long) (i / 200)));
+    if (bench_random() % 4 == 0)
+        bench_add(m, "if-none-match", bench_printf("\"%016llx\"", (unsigned long long) bench_random()));
+}
+
+
+/* JSON API responses from a handful of backends */
+static void bench_api(struct bench_message_t *m, size_t i)
+{
+    bench_add(m, ":status", bench_printf("%s", i % 20 ? "200" : bench_pick("404", "304", "500", "201")));
+    bench_add_str(m, "content-type", "application/json; charset=utf-8");
+    bench_add(m, "content-length", bench_printf("%u", (unsigned) (bench_random() % 20000)));
+    bench_add(m, "date", bench_printf("Mon, 16 Oct 2023 12:%02u:%02u GMT", (unsigned) (i / 60 % 60), (unsigned) (i % 60)));
+    bench_add(m, "server", bench_printf("%s", bench_pick("envoy", "nginx/1.25.3")));
+    bench_add_str(m, "cache-control", "no-cache, no-store, must-revalidate");
+    bench_add_str(m, "vary", "Accept-Encoding, Origin");
+    bench_add_str(m, "strict-transport-security", "max-age=63072000; includeSubDomains; preload");
+    bench_add_str(m, "x-content-type-options", "nosniff");
+    bench_add(m, "x-request-id", bench_printf("%08x-%04x-4%03x-%04x-%012llx", (uint32_t) bench_random(),
+        (unsigned) (bench_random() & 0xFFFF), (unsigned) (bench_random() & 0xFFF), (unsigned) (bench_random() & 0xFFFF),
+        (unsigned long long) (bench_random() & 0xFFFFFFFFFFFFull)));
+    bench_add(m, "x-envoy-upstream-service-time", bench_printf("%u", (unsigned) (bench_random() % 300)));
+    bench_add(m, "access-control-allow-origin", bench_printf("%s", bench_pick("https://app.example.com", "*")));
+}
+
+
+/* unary gRPC requests to a few methods, with tracing metadata */
+static void bench_grpc(struct bench_message_t *m, size_t i)
+{
+    (void) i;
+    bench_add_str(m, ":method", "POST");
+    bench_add_str(m, ":scheme", "http");
+    bench_add(m, ":path", bench_printf("/%s", bench_pick("inventory.v1.Inventory/GetItem", "inventory.v1.Inventory/ListItems",
+        "billing.v2.Billing/Charge", "auth.v1.Auth/Check")));
+    bench_add_str(m, ":authority", "inventory.internal.svc.cluster.local:8443");
+    bench_add_str(m, "content-type", "application/grpc");
+    bench_add_str(m, "te", "trailers");
+    bench_add_str(m, "user-agent", "grpc-c++/1.59.0 grpc-c/36.0.0 (linux; chttp2)");
+    bench_add_str(m, "grpc-accept-encoding", "identity, deflate, gzip");
+    bench_add(m, "grpc-timeout", bench_printf("%uu", (unsigned) (bench_random() % 1000000)));
+    bench_add(m, "traceparent", bench_printf("00-%016llx%016llx-%016llx-01", (unsigned long long) bench_random(),
+        (unsigned long long) bench_random(), (unsigned long long) bench_random()));
+    bench_add(m, "x-tenant-id", bench_printf("tenant-%u", (unsigned) (bench_random() % 16)));
+}
+
+
+/* big cookies, mostly repeated between requests but with some crumbs changing */
+static void bench_cookies(struct bench_message_t *m, size_t i)
+{
+    bench_add_str(m, ":method", "GET");
+    bench_add_str(m, ":scheme", "https");
+    bench_add_str(m, ":authority", "portal.example.com");
+    bench_add(m, ":path", bench_printf("/dashboard?tab=%u", (unsigned) (bench_random() % 10)));
+    bench_add_str(m, "user-agent", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36");
+    bench_add_str(m, "accept", "*/*");
+    for (size_t k = 0; k < 6; k++) {
+        // each crumb is stable for a while; crumb k changes every 2^(k+1) requests
+        uint64_t seed = (i >> (k + 1)) * 0x9E3779B97F4A7C15ull + k;
+        char value[400];
+        for (size_t j = 0; j < sizeof(value) - 1; j++, seed = seed * 6364136223846793005ull + 1442695040888963407ull)
+            value[j] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"[seed >> 58];
+        value[sizeof(value) - 1] = 0;
+        bench_add(m, "cookie", bench_printf("crumb%zu=%s", k, value));
+    }
+}
+
+
+static const struct bench_corpus_t BENCH_CORPORA[] = {
+    { "browser", &bench_browser },
+    { "api",     &bench_api     },
+    { "grpc",    &bench_grpc    },
+    { "cookies", &bench_cookies },
+};
+
+
+static struct bench_message_t BENCH_CORPUS[BENCH_MESSAGES];
+
+
+static int bench_run(const struct bench_corpus_t *c, uint32_t table, size_t rounds)
+{
+    struct cno_hpack_t encoder;
+    struct cno_hpack_t decoder;
+    struct cno_buffer_dyn_t out = CNO_BUFFER_DYN_EMPTY;
+    size_t offsets[BENCH_MESSAGES + 1] = { 0 };
+    size_t headers = 0;
+
+    // first pass (untimed) records the encoded blocks for the decoder.
+    cno_hpack_init(&encoder, table);
+    for (size_t i = 0; i < BENCH_MESSAGES; i++) {
+        if (cno_hpack_encode(&encoder, &out, BENCH_CORPUS[i].headers, BENCH_CORPUS[i].count))
+            goto error;
+        offsets[i + 1] = out.size;
+        headers += BENCH_CORPUS[i].count;
+    }
+    struct cno_hpack_stats_t stats = encoder.stats;
+    cno_hpack_clear(&encoder);
+
+    struct cno_buffer_dyn_t scratch = CNO_BUFFER_DYN_EMPTY;
+    if (cno_buffer_dyn_reserve(&scratch, out.size))
+        goto error;
+
+    size_t allocs = bench_allocs.count;
+    double start = bench_now();
+    for (size_t r = 0; r < rounds; r++) {
+        cno_hpack_init(&encoder, table);
+        for (size_t i = 0; i < BENCH_MESSAGES; i++) {
+            scratch.size = 0;
+            if (cno_hpack_encode(&encoder, &scratch, BENCH_CORPUS[i].headers, BENCH_CORPUS[i].count))
+                goto error;
+        }
+        cno_hpack_clear(&encoder);
+    }
+    double encode_time = bench_now() - start;
+    size_t encode_allocs = bench_allocs.count - allocs;
+
+    allocs = bench_allocs.count;
+    start = bench_now();
+    for (size_t r = 0; r < rounds; r++) {
+        cno_hpack_init(&decoder, table);
+        for (size_t i = 0; i < BENCH_MESSAGES; i++) {
+            struct cno_header_t result[BENCH_MAX_HEADERS];
+            size_t count = BENCH_MAX_HEADERS;
+            struct cno_buffer_t block = { out.data + offsets[i], offsets[i + 1] - offsets[i] };
+            if (cno_hpack_decode(&decoder, block, result, &count))
+                goto error;
+            if (count != BENCH_CORPUS[i].count) {
+                fprintf(stderr, "%s: decoded %zu headers instead of %zu\n", c->name, count, BENCH_CORPUS[i].count);
+                return -1;
+            }
+        }
+        cno_hpack_clear(&decoder);
+    }
+    double decode_time = bench_now() - start;
+    size_t decode_allocs = bench_allocs.count - allocs;
+
+    double total = (double) rounds * headers;
+    printf("%-8s %6u %8.1f %10.0f %8.1f %10.0f %6.3f %6.1f%% %8.2f %8.2f\n", c->name, table,
+        stats.plain * rounds / encode_time / 1048576, total / encode_time,
+        stats.plain * rounds / decode_time / 1048576, total / decode_time,
+        (double) stats.encoded / stats.plain, 100.0 * stats.dynamic_hits / stats.headers,
+        (double) encode_allocs / rounds / BENCH_MESSAGES, (double) decode_allocs / rounds / BENCH_MESSAGES);
+    cno_buffer_dyn_clear(&scratch);
+    cno_buffer_dyn_clear(&out);
+    return 0;
+
+error:
+    fprintf(stderr, "%s: %s\n", c->name, cno_error()->text);
+    cno_hpack_clear(&encoder);
+    cno_buffer_dyn_clear(&out);
+    return -1;
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t rounds = 50 * bench_scale();
+    int failed = 0;
+
+    if (rounds == 0)
+        rounds = 1;
+
+    printf("%-8s %6s %8s %10s %8s %10s %6s %7s %8s %8s\n", "corpus", "table",
+        "enc MiB/s", "enc hdr/s", "dec MiB/s", "dec hdr/s", "ratio", "dyn", "enc a/m", "dec a/m");
+    for (size_t i = 0; i < sizeof(BENCH_CORPORA) / sizeof(*BENCH_CORPORA); i++) {
+        const struct bench_corpus_t *c = &BENCH_CORPORA[i];
+        if (argc >= 2 && strncmp(c->name, argv[1], strlen(argv[1])))
+            continue;
+
+        BENCH_POOL_SIZE = 0;
+        BENCH_RNG = 0x9E3779B97F4A7C15ull;
+        for (size_t j = 0; j < BENCH_MESSAGES; j++) {
+            BENCH_CORPUS[j].count = 0;
+            c->generate(&BENCH_CORPUS[j], j);
+        }
+
+        for (size_t j = 0; j < sizeof(BENCH_TABLE_SIZES) / sizeof(*BENCH_TABLE_SIZES); j++)
+            failed |= bench_run(c, BENCH_TABLE_SIZES[j], rounds);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,393 @@
+/* A client and a server connected to each other in memory. There is no I/O at all,
+ * so the numbers are purely the cost of cno itself (plus a memcpy per write).
+ *
+ *     make bench
+ *     BENCH_SCALE=0.1 obj/bench-loopback [scenario-name-prefix]
+ *
+ * When built with CNO_ALLOC_ACCOUNTING (`make allocs`), this also breaks down the
+ * allocations made after a warm-up period by call site and by what was being done at
+ * the time (API call or frame type), and fails if there are more of them per request
+ * than the scenario's budget.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "../cno/core.h"
+#include "bench.h"
+
+#define BENCH_CHUNK      65536
+#define BENCH_BODY_MAX   (1024 * 1024)
+#define BENCH_OUT_BUFFER (4 * 1024 * 1024)
+
+/* Allocation budgets per request, in steady state. Each includes both the client and the
+   server side, since they run in the same thread. */
+#define BUDGET_H1 0
+#define BUDGET_H2 0
+
+
+struct bench_scenario_t
+{
+    const char *name;
+    enum CNO_HTTP_VERSION version;
+    size_t requests;
+    size_t concurrency;
+    size_t request_body;
+    size_t response_body;
+    size_t pushes;
+    size_t frame_size;  // if nonzero, both sides accept DATA frames this big (default 16 KiB)
+    size_t read_size;   // if nonzero, deliver the output in pieces this big, like a socket would
+    double budget;  // allocations per request after warm-up, both sides combined
+};
+
+
+static const struct bench_scenario_t BENCH_SCENARIOS[] = {
+    { "http1-keepalive",  CNO_HTTP1, 200000,   1, 0,                0,                0, 0,       0,     BUDGET_H1 },
+    { "http1-upload",     CNO_HTTP1,    100,   1, 16 * 1024 * 1024, 0,                0, 0,       0,     BUDGET_H1 },
+    { "http1-download",   CNO_HTTP1,    100,   1, 0,                16 * 1024 * 1024, 0, 0,       0,     BUDGET_H1 },
+    { "http2-unary",      CNO_HTTP2, 200000, 100, 0,                0,                0, 0,       0,     BUDGET_H2 },
+    { "http2-unary-body", CNO_HTTP2, 100000, 100, 1024,             1024,             0, 0,       0,     BUDGET_H2 },
+    { "http2-upload",     CNO_HTTP2,    100,   1, 16 * 1024 * 1024, 0,                0, 0,       0,     BUDGET_H2 },
+    { "http2-download",   CNO_HTTP2,    100,   1, 0,                16 * 1024 * 1024, 0, 0,       0,     BUDGET_H2 },
+    { "http2-push",       CNO_HTTP2,  50000,  10, 0,                256,              4, 0,       0,     BUDGET_H2 * 5 },
+    { "http2-bulk-split", CNO_HTTP2,    100,   1, 16 * 1024 * 1024, 0,                0, 0,       16384, BUDGET_H2 },
+    { "http2-bulk-1m",    CNO_HTTP2,    100,   1, 0,                16 * 1024 * 1024, 0, 1 << 20, 16384, BUDGET_H2 },
+};
+
+
+static const char *BENCH_FRAME_NAMES[] = {
+    "recv DATA", "recv HEADERS", "recv PRIORITY", "recv RST_STREAM", "recv SETTINGS",
+    "recv PUSH_PROMISE", "recv PING", "recv GOAWAY", "recv WINDOW_UPDATE", "recv CONTINUATION",
+    "recv unknown frame",
+};
+
+
+/* A payload that can't be sent in one go; resumed whenever the peer drains the output. */
+struct bench_writer_t
+{
+    uint32_t stream;
+    size_t left;
+};
+
+
+struct bench_peer_t
+{
+    struct cno_connection_t conn;
+    const struct bench_scenario_t *scenario;
+    struct bench_writer_t writers[128];
+    size_t writer_count;
+    size_t out_size;
+    size_t frames;
+    size_t bytes;
+    size_t responses;
+    size_t pushes;
+    char out[BENCH_OUT_BUFFER];
+};
+
+
+static char BENCH_BODY[BENCH_BODY_MAX];
+
+
+static int bench_on_write(void *data, const char *buf, size_t size)
+{
+    struct bench_peer_t *p = data;
+    if (p->out_size + size > sizeof(p->out)) {
+        fprintf(stderr, "loopback buffer overflow\n");
+        abort();
+    }
+    memcpy(p->out + p->out_size, buf, size);
+    p->out_size += size;
+    p->bytes += size;
+    return 0;
+}
+
+
+static int bench_on_frame(void *data, const struct cno_frame_t *frame)
+{
+    // the frame is handled right after this returns, until the next one arrives.
+    bench_context(BENCH_FRAME_NAMES[frame->type < CNO_FRAME_UNKNOWN ? frame->type : CNO_FRAME_UNKNOWN]);
+    ((struct bench_peer_t *) data)->frames++;
+    return 0;
+}
+
+
+static int bench_write_body(struct bench_peer_t *p, uint32_t stream, size_t size)
+{
+    if (size == 0)
+        return 0;
+    if (p->writer_count == sizeof(p->writers) / sizeof(*p->writers)) {
+        fprintf(stderr, "too many concurrent uploads\n");
+        abort();
+    }
+    p->writers[p->writer_count++] = (struct bench_writer_t) { stream, size };
+    return 0;
+}
+
+
+/* Send at most one chunk per pending payload; returns 1 if anything was written. */
+static int bench_flush(struct bench_peer_t *p)
+{
+    int moved = 0;
+    for (size_t i = 0; i < p->writer_count;) {
+        struct bench_writer_t *w = &p->writers[i];
+        size_t chunk = p->scenario->frame_size ? p->scenario->frame_size : BENCH_CHUNK;
+        size_t size = w->left < chunk ? w->left : chunk;
+        const char *context = bench_context("cno_write_data");
+        int sent = cno_write_data(&p->conn, w->stream, BENCH_BODY, size, size == w->left);
+        bench_context(context);
+        if (sent < 0)
+            return -1;
+        if (sent)
+            moved = 1;
+        if ((w->left -= sent) == 0)
+            *w = p->writers[--p->writer_count];
+        else
+            i++;
+    }
+    return moved;
+}
+
+
+static int bench_write_head(struct bench_peer_t *p, uint32_t stream, int code, const char *path, size_t body)
+{
+    char length[32];
+    struct cno_header_t headers[] = {
+        { CNO_BUFFER_STRING(":authority"), CNO_BUFFER_STRING("localhost"), 0, 0 },
+        { CNO_BUFFER_STRING(":scheme"), CNO_BUFFER_STRING("http"), 0, 0 },
+        { CNO_BUFFER_STRING("content-length"), { length, snprintf(length, sizeof(length), "%zu", body) }, 0, 0 },
+        { CNO_BUFFER_STRING("user-agent"), CNO_BUFFER_STRING("libcno-bench/1.0"), 0, 0 },
+        { CNO_BUFFER_STRING("accept-encoding"), CNO_BUFFER_STRING("gzip, deflate"), 0, 0 },
+    };
+    struct cno_header_t *head = code ? &headers[2] : headers;
+    struct cno_message_t msg = { code, CNO_BUFFER_STRING("GET"), { path, strlen(path) }, head, code ? 1 : 5, NULL };
+    if (code == 0 && body)
+        msg.method = CNO_BUFFER_STRING("POST");
+    const char *context = bench_context("cno_write_message");
+    int failed = cno_write_message(&p->conn, stream, &msg, body == 0);
+    bench_context(context);
+    if (failed)
+        return -1;
+    return bench_write_body(p, stream, body);
+}
+
+
+static int bench_on_message_end(void *data, uint32_t stream)
+{
+    struct bench_peer_t *p = data;
+
+    if (p->conn.client) {
+        if (stream % 2)
+            p->responses++;
+        else
+            p->pushes++;
+        return 0;
+    }
+
+    if (stream % 2) {
+        for (size_t i = 0; i < p->scenario->pushes; i++) {
+            char path[48];
+            snprintf(path, sizeof(path), "/static/%zu.css", i);
+            struct cno_header_t headers[] = {
+                { CNO_BUFFER_STRING(":authority"), CNO_BUFFER_STRING("localhost"), 0, 0 },
+                { CNO_BUFFER_STRING(":scheme"), CNO_BUFFER_STRING("http"), 0, 0 },
+            };
+            struct cno_message_t msg = { 0, CNO_BUFFER_STRING("GET"), { path, strlen(path) }, headers, 2, NULL };
+            // this fires on_message_end for the promised stream, which responds to it below.
+            const char *context = bench_context("cno_write_push");
+            int failed = cno_write_push(&p->conn, stream, &msg);
+            bench_context(context);
+            if (failed)
+                return -1;
+        }
+    }
+    return bench_write_head(p, stream, 200, "", p->scenario->response_body);
+}
+
+
+/* Move bytes back and forth until both sides have nothing more to say. */
+static int bench_pump(struct bench_peer_t *a, struct bench_peer_t *b)
+{
+    for (int moved = 1; moved;) {
+        moved = 0;
+        for (int i = 0; i < 2; i++) {
+            struct bench_peer_t *src = i ? b : a;
+            struct bench_peer_t *dst = i ? a : b;
+            if (src->out_size) {
+                size_t size = src->out_size;
+                size_t step = src->scenario->read_size ? src->scenario->read_size : size;
+                src->out_size = 0;
+                bench_context("cno_connection_data_received");
+                for (size_t off = 0; off < size; off += step)
+                    if (cno_connection_data_received(&dst->conn, src->out + off, size - off < step ? size - off : step))
+                        return -1;
+                bench_context("");
+                moved = 1;
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            int r = bench_flush(i ? b : a);
+            if (r < 0)
+                return -1;
+            moved |= r;
+        }
+    }
+    return 0;
+}
+
+
+#if CNO_ALLOC_ACCOUNTING
+static int bench_site_cmp(const void *a, const void *b)
+{
+    const struct cno_alloc_site_t *x = a;
+    const struct cno_alloc_site_t *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+
+/* Print the counters merged by name (inline functions have one `__func__` per object
+   file) and check the total against the budget. */
+static int bench_alloc_report(const struct bench_scenario_t *s, size_t requests)
+{
+    size_t n = 0;
+    size_t merged = 0;
+    uint64_t total = 0;
+    const struct cno_alloc_site_t *sites = cno_alloc_stats(&n);
+    struct cno_alloc_site_t m[n + 1];
+
+    for (size_t i = 0; i < n; i++) {
+        size_t j = 0;
+        total += sites[i].count;
+        while (j < merged && (strcmp(m[j].site, sites[i].site) || strcmp(m[j].context, sites[i].context)))
+            j++;
+        if (j == merged)
+            m[merged++] = (struct cno_alloc_site_t) { sites[i].context, sites[i].site, 0, 0 };
+        m[j].count += sites[i].count;
+        m[j].bytes += sites[i].bytes;
+    }
+
+    qsort(m, merged, sizeof(*m), &bench_site_cmp);
+    printf("%s: %.2f allocations per request after %zu requests (budget %.2f)\n", s->name,
+        (double) total / requests, requests, s->budget);
+    for (size_t i = 0; i < merged; i++)
+        printf("    %-30s %-26s %10.3f/req %10.1f bytes/req\n", m[i].context, m[i].site,
+            (double) m[i].count / requests, (double) m[i].bytes / requests);
+    if ((double) total / requests <= s->budget)
+        return 0;
+    printf("%s: over budget\n", s->name);
+    return -1;
+}
+#else
+static int bench_alloc_report(const struct bench_scenario_t *s, size_t requests)
+{
+    (void) s;
+    (void) requests;
+    return 0;
+}
+#endif
+
+
+static int bench_run(const struct bench_scenario_t *s, double scale)
+{
+    static struct bench_peer_t client;
+    static struct bench_peer_t server;
+    struct bench_peer_t *peers[] = { &client, &server };
+
+    for (int i = 0; i < 2; i++) {
+        struct bench_peer_t *p = peers[i];
+        p->scenario = s;
+        p->writer_count = p->out_size = p->frames = p->bytes = p->responses = p->pushes = 0;
+        cno_connection_init(&p->conn, i ? CNO_SERVER : CNO_CLIENT);
+        p->conn.cb_data = p;
+        p->conn.on_write = &bench_on_write;
+        p->conn.on_frame = &bench_on_frame;
+        p->conn.on_message_end = &bench_on_message_end;
+    }
+
+    size_t requests = s->requests * scale;
+    if (requests < s->concurrency)
+        requests = s->concurrency;
+
+    size_t allocs = bench_allocs.count;
+    size_t warmup = 0;  // requests sent before the allocation counters were last reset
+    int warmed_up = 0;
+    double start = bench_now();
+
+    if (s->frame_size) {
+        for (int i = 0; i < 2; i++) {
+            struct cno_settings_t settings = peers[i]->conn.settings[CNO_LOCAL];
+            settings.max_frame_size = s->frame_size;
+            settings.initial_window_size = 16 * s->frame_size;
+            if (cno_connection_set_config(&peers[i]->conn, &settings))
+                goto error;
+        }
+    }
+
+    if (cno_connection_made(&client.conn, s->version)
+     || cno_connection_made(&server.conn, s->version))
+        goto error;
+
+    if (s->frame_size) {
+        // the connection-level window can only be opened with an explicit update.
+        struct cno_frame_t update = { CNO_FRAME_WINDOW_UPDATE, 0, 0, { "\x00\xf0\x00\x00", 4 } };
+        for (int i = 0; i < 2; i++)
+            if (cno_write_frame(&peers[i]->conn, &update))
+                goto error;
+    }
+
+    // if all requests fit into the first round, there is no warm-up to exclude.
+    bench_alloc_stats_reset();
+    for (size_t sent = 0; sent < requests;) {
+        if (!warmed_up && sent >= (requests < 10 ? 1 : requests / 10)) {
+            // buffers have grown to their final sizes by now; everything else is per-request.
+            bench_alloc_stats_reset();
+            warmup = sent;
+            warmed_up = 1;
+        }
+        for (size_t i = 0; i < s->concurrency && sent < requests; i++, sent++)
+            if (bench_write_head(&client, cno_connection_next_stream(&client.conn), 0, "/api/v1/items?page=1", s->request_body))
+                goto error;
+        if (bench_pump(&client, &server))
+            goto error;
+    }
+
+    double elapsed = bench_now() - start;
+    allocs = bench_allocs.count - allocs;
+    int over_budget = bench_alloc_report(s, requests - warmup);
+
+    if (cno_connection_lost(&client.conn) || cno_connection_lost(&server.conn))
+        goto error;
+    cno_connection_reset(&client.conn);
+    cno_connection_reset(&server.conn);
+
+    if (client.responses != requests || client.pushes != requests * s->pushes) {
+        fprintf(stderr, "%s: got %zu/%zu responses, %zu/%zu pushes\n", s->name,
+            client.responses, requests, client.pushes, requests * s->pushes);
+        return -1;
+    }
+
+    size_t frames = client.frames + server.frames;
+    char ns_per_frame[32] = "-";
+    if (frames)
+        snprintf(ns_per_frame, sizeof(ns_per_frame), "%.1f", elapsed * 1e9 / frames);
+    printf("%-18s %10zu %12.0f %10.1f %10s %12.2f\n", s->name, requests, requests / elapsed,
+        (client.bytes + server.bytes) / elapsed / 1048576, ns_per_frame, (double) allocs / requests);
+    return over_budget;
+
+error:
+    fprintf(stderr, "%s: %s\n", s->name, cno_error()->text);
+    cno_connection_reset(&client.conn);
+    cno_connection_reset(&server.conn);
+    return -1;
+}
+
+
+int main(int argc, char **argv)
+{
+    double scale = bench_scale();
+    int failed = 0;
+
+    printf("%-18s %10s %12s %10s %10s %12s\n", "scenario", "requests", "req/s", "MiB/s", "ns/frame", "allocs/req");
+    for (size_t i = 0; i < sizeof(BENCH_SCENARIOS) / sizeof(*BENCH_SCENARIOS); i++)
+        if (argc < 2 || !strncmp(BENCH_SCENARIOS[i].name, argv[1], strlen(argv[1])))
+            failed |= bench_run(&BENCH_SCENARIOS[i], scale);
+    return failed ? 1 : 0;
+}
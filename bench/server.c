@@ -0,0 +1,264 @@
+/* A reference server built on cno/loop.c: answers every request with a fixed body.
+ * Speaks HTTP/1.1 and h2c with prior knowledge.
+ *
+ *     make obj/bench-server
+ *     obj/bench-server [-p port] [-t threads] [-b body size] [-H host] [-u] [-w handlers]
+ *     h2load -n 1000000 -c 100 -m 10 -t 4 http://127.0.0.1:8000/
+ *     h2load -n 1000000 -c 100 -t 4 --h1 http://127.0.0.1:8000/
+ *
+ * `-u` uses io_uring instead of epoll. `-w` hands requests to a pool of handler threads,
+ * which respond through `cno_loop_post_*`. Stops on SIGINT/SIGTERM.
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../cno/loop.h"
+
+#define SERVER_STREAMS 128
+#define SERVER_BODY_MAX (16 * 1024 * 1024)
+#define SERVER_MIN_FRAME 4096
+
+
+/* A response body that did not fit into the flow control window. */
+struct server_writer_t
+{
+    uint32_t stream;
+    size_t left;
+};
+
+
+struct server_conn_t
+{
+    struct server_writer_t writers[SERVER_STREAMS];
+    size_t writer_count;
+};
+
+
+/* A request passed to a handler thread. */
+struct server_job_t
+{
+    struct server_job_t *next;
+    struct cno_loop_conn_t *conn;
+    uint32_t stream;
+};
+
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct server_job_t *first;
+    struct server_job_t *last;
+    int stop;
+} SERVER_JOBS = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+
+static char SERVER_BODY[SERVER_BODY_MAX];
+static size_t SERVER_BODY_SIZE = 14;
+static char SERVER_BODY_LENGTH[24];
+static struct cno_header_template_t SERVER_HEADERS;
+
+
+static int server_flush(struct cno_loop_conn_t *c, uint32_t stream)
+{
+    struct server_conn_t *s = c->data;
+    for (size_t i = 0; i < s->writer_count;) {
+        struct server_writer_t w = s->writers[i];
+        // wait until a reasonably sized DATA frame can be sent, or the window
+        // increments (one per DATA frame received by the peer) get smaller and smaller.
+        if ((stream && w.stream != stream) || (size_t) c->conn.window_send < (w.left < SERVER_MIN_FRAME ? w.left : SERVER_MIN_FRAME)) {
+            i++;
+            continue;
+        }
+        // sending the last byte fires on_stream_end, so take the writer out first.
+        s->writers[i] = s->writers[--s->writer_count];
+        int sent = cno_write_data(&c->conn, w.stream, SERVER_BODY + (SERVER_BODY_SIZE - w.left), w.left, 1);
+        if (sent < 0)
+            return -1;
+        if ((w.left -= sent)) {
+            s->writers[s->writer_count++] = s->writers[i];
+            s->writers[i++] = w;
+        }
+    }
+    return 0;
+}
+
+
+static void *server_handler(void *arg)
+{
+    (void) arg;
+    struct cno_header_t headers[] = {
+        { CNO_BUFFER_STRING("content-length"), { SERVER_BODY_LENGTH, strlen(SERVER_BODY_LENGTH) }, 0, 0 },
+    };
+    struct cno_message_t msg = { 200, CNO_BUFFER_EMPTY, CNO_BUFFER_EMPTY, headers, 1, &SERVER_HEADERS };
+    while (1) {
+        pthread_mutex_lock(&SERVER_JOBS.lock);
+        while (!SERVER_JOBS.first && !SERVER_JOBS.stop)
+            pthread_cond_wait(&SERVER_JOBS.wake, &SERVER_JOBS.lock);
+        struct server_job_t *job = SERVER_JOBS.first;
+        if (job && !(SERVER_JOBS.first = job->next))
+            SERVER_JOBS.last = NULL;
+        pthread_mutex_unlock(&SERVER_JOBS.lock);
+        if (!job)
+            return NULL;
+        // the body is copied, which is fine for a benchmark of the queue itself.
+        if (cno_loop_post_message(job->conn, job->stream, &msg, SERVER_BODY_SIZE == 0)
+         || (SERVER_BODY_SIZE && cno_loop_post_data(job->conn, job->stream, SERVER_BODY, SERVER_BODY_SIZE, 1)))
+            cno_loop_post_reset(job->conn, job->stream, CNO_RST_INTERNAL_ERROR);
+        cno_loop_conn_unref(job->conn);
+        free(job);
+    }
+}
+
+
+static int server_on_message_end_async(void *data, uint32_t stream)
+{
+    struct server_job_t *job = malloc(sizeof(*job));
+    if (!job)
+        return CNO_ERROR(NO_MEMORY, "%zu bytes", sizeof(*job));
+    *job = (struct server_job_t) { NULL, data, stream };
+    cno_loop_conn_ref(job->conn);
+    pthread_mutex_lock(&SERVER_JOBS.lock);
+    *(SERVER_JOBS.last ? &SERVER_JOBS.last->next : &SERVER_JOBS.first) = job;
+    SERVER_JOBS.last = job;
+    pthread_cond_signal(&SERVER_JOBS.wake);
+    pthread_mutex_unlock(&SERVER_JOBS.lock);
+    return CNO_OK;
+}
+
+
+static int server_on_message_end(void *data, uint32_t stream)
+{
+    struct cno_loop_conn_t *c = data;
+    struct server_conn_t *s = c->data;
+    struct cno_header_t headers[] = {
+        { CNO_BUFFER_STRING("content-length"), { SERVER_BODY_LENGTH, strlen(SERVER_BODY_LENGTH) }, 0, 0 },
+    };
+    struct cno_message_t msg = { 200, CNO_BUFFER_EMPTY, CNO_BUFFER_EMPTY, headers, 1, &SERVER_HEADERS };
+    if (cno_write_message(&c->conn, stream, &msg, SERVER_BODY_SIZE == 0))
+        return -1;
+    if (SERVER_BODY_SIZE == 0)
+        return 0;
+    if (s->writer_count == SERVER_STREAMS)
+        return CNO_ERROR(ASSERTION, "more streams than SETTINGS_MAX_CONCURRENT_STREAMS");
+    s->writers[s->writer_count++] = (struct server_writer_t) { stream, SERVER_BODY_SIZE };
+    return server_flush(c, stream);
+}
+
+
+static int server_on_flow_increase(void *data, uint32_t stream)
+{
+    return server_flush(data, stream);
+}
+
+
+static int server_on_stream_end(void *data, uint32_t stream)
+{
+    // reset by the client before the whole response has been sent
+    struct server_conn_t *s = ((struct cno_loop_conn_t *) data)->data;
+    for (size_t i = 0; i < s->writer_count; i++)
+        if (s->writers[i].stream == stream) {
+            s->writers[i] = s->writers[--s->writer_count];
+            break;
+        }
+    return 0;
+}
+
+
+static int server_on_accept(void *data, struct cno_loop_conn_t *c)
+{
+    if (data) {
+        c->conn.on_message_end = &server_on_message_end_async;
+        return CNO_OK;
+    }
+    struct server_conn_t *s = malloc(sizeof(*s));
+    if (!s)
+        return CNO_ERROR(NO_MEMORY, "%zu bytes", sizeof(*s));
+    s->writer_count = 0;
+    c->data = s;
+    c->conn.on_message_end   = &server_on_message_end;
+    c->conn.on_flow_increase = &server_on_flow_increase;
+    c->conn.on_stream_end    = &server_on_stream_end;
+
+    struct cno_settings_t settings = c->conn.settings[CNO_LOCAL];
+    settings.max_concurrent_streams = SERVER_STREAMS;
+    return cno_connection_set_config(&c->conn, &settings);
+}
+
+
+static void server_on_close(void *data, struct cno_loop_conn_t *c)
+{
+    (void) data;
+    free(c->data);  // NULL with -w
+}
+
+
+int main(int argc, char **argv)
+{
+    struct cno_loop_t loop = { .port = 8000, .on_accept = &server_on_accept, .on_close = &server_on_close };
+    unsigned handlers = 0;
+
+    for (int opt; (opt = getopt(argc, argv, "p:t:b:H:uw:")) != -1;) switch (opt) {
+        case 'p': loop.port = atoi(optarg); break;
+        case 't': loop.threads = atoi(optarg); break;
+        case 'b': SERVER_BODY_SIZE = strtoul(optarg, NULL, 10); break;
+        case 'H': loop.host = optarg; break;
+        case 'u': loop.uring = 1; break;
+        case 'w': handlers = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-t threads] [-b body size] [-H host] [-u] [-w handlers]\n", argv[0]);
+            return 2;
+    }
+
+    if (SERVER_BODY_SIZE > SERVER_BODY_MAX)
+        SERVER_BODY_SIZE = SERVER_BODY_MAX;
+    memset(SERVER_BODY, 'x', SERVER_BODY_SIZE);
+    if (SERVER_BODY_SIZE >= 14)
+        memcpy(SERVER_BODY, "Hello, World!\n", 14);
+    snprintf(SERVER_BODY_LENGTH, sizeof(SERVER_BODY_LENGTH), "%zu", SERVER_BODY_SIZE);
+
+    struct cno_header_t headers[] = {
+        { CNO_BUFFER_STRING("server"), CNO_BUFFER_STRING("libcno"), 0, 0 },
+        { CNO_BUFFER_STRING("content-type"), CNO_BUFFER_STRING("text/plain"), 0, 0 },
+    };
+    if (cno_header_template_init(&SERVER_HEADERS, headers, 2))
+        return fprintf(stderr, "%s\n", cno_error()->text), 1;
+
+    // the workers inherit the mask, so the signals can only be received here.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_t threads[handlers ? handlers : 1];
+    for (unsigned i = 0; i < handlers; i++)
+        if (pthread_create(&threads[i], NULL, &server_handler, NULL))
+            return fprintf(stderr, "pthread_create failed\n"), 1;
+    loop.cb_data = handlers ? &SERVER_JOBS : NULL;
+    if (cno_loop_start(&loop))
+        return fprintf(stderr, "%s\n", cno_error()->text), 1;
+    fprintf(stderr, "listening on port %u with %u %s threads, %zu-byte responses\n", loop.port, loop.running,
+            loop.uring ? "io_uring" : "epoll", SERVER_BODY_SIZE);
+
+    int sig;
+    sigwait(&signals, &sig);
+    // the handlers hold references to connections, so they go first.
+    pthread_mutex_lock(&SERVER_JOBS.lock);
+    SERVER_JOBS.stop = 1;
+    pthread_cond_broadcast(&SERVER_JOBS.wake);
+    pthread_mutex_unlock(&SERVER_JOBS.lock);
+    for (unsigned i = 0; i < handlers; i++)
+        pthread_join(threads[i], NULL);
+    cno_loop_stop(&loop);
+    // requests that came in after the handlers stopped
+    for (struct server_job_t *job = SERVER_JOBS.first, *next; job; job = next) {
+        next = job->next;
+        free(job);
+    }
+    cno_header_template_clear(&SERVER_HEADERS);
+    return 0;
+}
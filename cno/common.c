@@ -7,13 +7,93 @@
 
 _Thread_local static struct cno_error_t E;
 
+// the message of the last error, unless it has already been written to `E.text`.
+// only integer conversions can be postponed, as those are the only arguments
+// guaranteed to survive until `cno_error` is called.
+#define CNO_ERROR_ARGS 4
+
+_Thread_local static struct
+{
+    const char *fmt;
+    long long args[CNO_ERROR_ARGS];
+} L;
+
+
+// see `cno_error_format` for what is supported.
+static int cno_error_defer(const char *fmt, va_list vl)
+{
+    int n = 0;
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%' || *++p == '%')
+            continue;
+        if (n == CNO_ERROR_ARGS)
+            return 0;
+        size_t spec = strspn(p, "-+ #0123456789.");
+        if (spec > 16)
+            return 0;
+        p += spec;
+        char length = 0;
+        if (*p == 'z' || *p == 'l')
+            length = *p++;
+        switch (*p) {
+            case 'i':
+            case 'd': L.args[n++] = length == 'z' ? (long long) va_arg(vl, size_t)
+                                  : length == 'l' ? va_arg(vl, long) : va_arg(vl, int); break;
+            case 'u':
+            case 'x':
+            case 'X': L.args[n++] = length == 'z' ? (long long) va_arg(vl, size_t)
+                                  : length == 'l' ? (long long) va_arg(vl, unsigned long)
+                                                  : (long long) va_arg(vl, unsigned); break;
+            default: return 0;
+        }
+    }
+    L.fmt = fmt;
+    return 1;
+}
+
+
+// `%[flags][width][.precision][z|l](d|i|u|x|X)` and `%%`; anything else is formatted immediately.
+static void cno_error_format(void)
+{
+    char *out = E.text, *end = E.text + sizeof(E.text);
+    long long *arg = L.args;
+    for (const char *p = L.fmt; *p && out < end - 1;) {
+        if (*p != '%' || p[1] == '%') {
+            *out++ = *p;
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+        char spec[24] = "%";
+        size_t n = strspn(p + 1, "-+ #0123456789.");
+        memcpy(spec + 1, p + 1, n);
+        p += n + 1;
+        if (*p == 'z' || *p == 'l')
+            p++;
+        // the argument has already been sign- or zero-extended to a long long.
+        memcpy(spec + n + 1, "ll", 2);
+        spec[n + 3] = *p++;
+        int w = snprintf(out, end - out, spec, *arg++);
+        out += w < 0 ? 0 : w < end - out ? w : end - out - 1;
+    }
+    *out = 0;
+    L.fmt = NULL;
+}
+
 
 const struct cno_error_t * cno_error(void)
 {
+    if (L.fmt)
+        cno_error_format();
     return &E;
 }
 
 
+int cno_error_code(void)
+{
+    return E.code;
+}
+
+
 int cno_error_set(const char *file, int line, int code, const char *fmt, ...)
 {
     E.code = code;
@@ -21,7 +101,12 @@ int cno_error_set(const char *file, int line, int code, const char *fmt, ...)
 
     va_list vl;
     va_start(vl, fmt);
-    vsnprintf(E.text, sizeof(E.text), fmt, vl);
+    if (!cno_error_defer(fmt, vl)) {
+        L.fmt = NULL;
+        va_end(vl);
+        va_start(vl, fmt);
+        vsnprintf(E.text, sizeof(E.text), fmt, vl);
+    }
     va_end(vl);
 
     return cno_error_upd(file, line);
@@ -30,8 +115,65 @@ int cno_error_set(const char *file, int line, int code, const char *fmt, ...)
 
 int cno_error_upd(const char *file, int line)
 {
+#if CNO_ERROR_TRACEBACK
     if (E.traceback_end != &E.traceback[sizeof(E.traceback) / sizeof(*E.traceback)])
         *E.traceback_end++ = (struct cno_traceback_t) { file, line };
-
+#else
+    (void) file;
+    (void) line;
+#endif
     return -1;
 }
+
+
+#if CNO_ALLOC_ACCOUNTING
+#undef malloc
+#undef realloc
+
+#define CNO_ALLOC_SITES 256
+
+_Thread_local static const char *A_CONTEXT = "";
+_Thread_local static size_t A_SITE_COUNT;
+_Thread_local static struct cno_alloc_site_t A_SITES[CNO_ALLOC_SITES];
+
+
+const char *cno_alloc_set_context(const char *context)
+{
+    const char *prev = A_CONTEXT;
+    A_CONTEXT = context;
+    return prev;
+}
+
+
+const struct cno_alloc_site_t *cno_alloc_stats(size_t *n)
+{
+    *n = A_SITE_COUNT;
+    return A_SITES;
+}
+
+
+void cno_alloc_stats_reset(void)
+{
+    A_SITE_COUNT = 0;
+}
+
+
+void *cno_alloc_counted(void *ptr, size_t size, const char *site)
+{
+    // compared by address; since an inline function's `__func__` is a separate object
+    // in each translation unit, the same name may appear in several entries.
+    struct cno_alloc_site_t *it = &A_SITES[0];
+    struct cno_alloc_site_t *end = &A_SITES[A_SITE_COUNT];
+    while (it != end && (it->site != site || it->context != A_CONTEXT))
+        it++;
+
+    if (it == end && A_SITE_COUNT < CNO_ALLOC_SITES)
+        *end = (struct cno_alloc_site_t) { A_CONTEXT, site, 0, 0 }, A_SITE_COUNT++;
+
+    if (it != &A_SITES[CNO_ALLOC_SITES]) {
+        it->count++;
+        it->bytes += size;
+    }
+    return realloc(ptr, size);
+}
+#endif
@@ -22,6 +22,7 @@ enum CNO_ERRNO
     CNO_ERRNO_WOULD_BLOCK     = 7,  // cno_write_message would go above the limit on concurrent messages - wait for a request to complete
     CNO_ERRNO_COMPRESSION     = 8,  // (irrecoverable) hpack error, compression now in inconsistent state
     CNO_ERRNO_DISCONNECT      = 9,  // connection has already been closed
+    CNO_ERRNO_TOO_LARGE       = 10, // (recoverable) inbound header list over the limit; hpack state is still consistent
 };
 
 
@@ -51,6 +52,17 @@ struct cno_buffer_t
 };
 
 
+/* Where to get memory from, if not libc. All functions get `ctx` as the first argument
+   and have the same semantics as their standard counterparts. */
+struct cno_allocator_t
+{
+    void *(*alloc)   (void *ctx, size_t);
+    void *(*realloc) (void *ctx, void *, size_t);
+    void  (*free)    (void *ctx, void *);
+    void *ctx;
+};
+
+
 struct cno_buffer_dyn_t
 {
     union {
@@ -62,6 +74,7 @@ struct cno_buffer_dyn_t
     };
     size_t offset;
     size_t cap;
+    const struct cno_allocator_t *allocator;  // NULL = libc; don't change while `data` is allocated
 };
 
 
@@ -89,7 +102,12 @@ struct cno_list_t
 /* Return some information about the last error in the current thread. */
 const struct cno_error_t * cno_error(void);
 
-/* Fail with a specified error code and message. */
+/* Same as `cno_error()->code`, but without formatting the message. */
+int cno_error_code(void);
+
+/* Fail with a specified error code and message. Unless there are `%s`-s or non-integer
+ * conversions in it, the message is only formatted when `cno_error` is next called,
+ * so `fmt` must stay valid until then (i.e. should be a literal). */
 int cno_error_set(const char *file, int line, int code,
                   const char *fmt, ...) __attribute__ ((format(printf, 4, 5)));
 
@@ -97,6 +115,50 @@ int cno_error_set(const char *file, int line, int code,
 int cno_error_upd(const char *file, int line);
 
 
+#if CNO_ALLOC_ACCOUNTING
+
+struct cno_alloc_site_t
+{
+    const char *context;  // the label set by `cno_alloc_set_context` at that moment
+    const char *site;     // the function that called malloc/realloc
+    uint64_t count;
+    uint64_t bytes;
+};
+
+/* Attribute all allocations made by this thread from now on to a label, e.g. the name
+   of an API call or of a frame type. The string must outlive the stats. Returns the
+   previous label so that it can be restored afterwards. */
+const char *cno_alloc_set_context(const char *);
+
+/* Get per-(context, site) counters for this thread; the order is unspecified. */
+const struct cno_alloc_site_t *cno_alloc_stats(size_t *n);
+
+/* Zero all counters for this thread. */
+void cno_alloc_stats_reset(void);
+
+void *cno_alloc_counted(void *, size_t, const char *site);
+
+#if !CFFI_CDEF_MODE
+#define malloc(n)     cno_alloc_counted(NULL, n, __func__)
+#define realloc(p, n) cno_alloc_counted(p, n, __func__)
+#endif
+
+#endif
+
+
+/* Header field validation. These process 16-32 bytes at a time using whatever vector
+   instructions the CPU supports (selected at load time), falling back to plain C. */
+
+/* Convert ASCII uppercase letters to lowercase in place. */
+void cno_header_name_lowercase(char *, size_t);
+
+/* Whether there are any ASCII uppercase letters (not allowed in HTTP 2 header names). */
+int cno_header_name_has_uppercase(const struct cno_buffer_t);
+
+/* Whether there are any NUL, CR, or LF characters (not allowed in header values). */
+int cno_header_value_is_invalid(const struct cno_buffer_t);
+
+
 #define CNO_ERROR(...)       cno_error_set(__FILE__, __LINE__, CNO_ERRNO_ ## __VA_ARGS__)
 #define CNO_ERROR_UP()       cno_error_upd(__FILE__, __LINE__)
 #define CNO_ERROR_NULL(...) (CNO_ERROR(__VA_ARGS__), NULL)
@@ -110,11 +172,16 @@ int cno_error_upd(const char *file, int line);
 
 
 static const struct cno_buffer_t     CNO_BUFFER_EMPTY     = { NULL, 0 };
-static const struct cno_buffer_dyn_t CNO_BUFFER_DYN_EMPTY = {{{NULL, 0}}, 0, 0};
+static const struct cno_buffer_dyn_t CNO_BUFFER_DYN_EMPTY = {{{NULL, 0}}, 0, 0, NULL};
 
 // cffi does not compile inline functions
 #if !CFFI_CDEF_MODE
 
+/* These are macros so that CNO_ALLOC_ACCOUNTING can see the caller's name. */
+#define cno_malloc(a, n)     ((a) ? (a)->alloc((a)->ctx, (n))           : malloc(n))
+#define cno_realloc(a, p, n) ((a) ? ((a)->realloc)((a)->ctx, (p), (n)) : realloc(p, n))
+#define cno_free(a, p)       ((a) ? (a)->free((a)->ctx, (p))            : free(p))
+
 static inline struct cno_buffer_t CNO_BUFFER_STRING(const char *s)
 {
     return (struct cno_buffer_t) { s, strlen(s) };
@@ -139,10 +206,13 @@ static inline int cno_buffer_endswith(const struct cno_buffer_t a, const struct
 }
 
 
+/* Deallocate the contents, but keep using the same allocator. */
 static inline void cno_buffer_dyn_clear(struct cno_buffer_dyn_t *x)
 {
-    free(x->data - x->offset);
+    const struct cno_allocator_t *a = x->allocator;
+    cno_free(a, x->data - x->offset);
     *x = CNO_BUFFER_DYN_EMPTY;
+    x->allocator = a;
 }
 
 
@@ -160,37 +230,41 @@ static inline int cno_buffer_dyn_reserve(struct cno_buffer_dyn_t *x, size_t n)
     if (n <= x->cap)
         return CNO_OK;
 
-    if (x->offset) {
+    if (n <= x->cap + x->offset) {
         memmove(x->data - x->offset, x->data, x->size);
         x->data  -= x->offset;
         x->cap   += x->offset;
         x->offset = 0;
-    }
-
-    if (n <= x->cap)
         return CNO_OK;
+    }
 
-    if (n < x->cap + CNO_BUFFER_ALLOC_MIN)
-        n = x->cap + CNO_BUFFER_ALLOC_MIN;
-    if (n < x->cap * CNO_BUFFER_ALLOC_MIN_EXP)
-        n = x->cap * CNO_BUFFER_ALLOC_MIN_EXP;
+    size_t total = x->cap + x->offset;
+    if (n < total + CNO_BUFFER_ALLOC_MIN)
+        n = total + CNO_BUFFER_ALLOC_MIN;
+    if (n < total * CNO_BUFFER_ALLOC_MIN_EXP)
+        n = total * CNO_BUFFER_ALLOC_MIN_EXP;
 
-    char *m = (char *) malloc(n);
+    // `realloc` would copy the consumed prefix too, and then it would have to be
+    // moved out of the way; with an offset, copy only the live part into a new block.
+    char *m = (char *) (x->offset ? cno_malloc(x->allocator, n) : cno_realloc(x->allocator, x->data, n));
     if (m == NULL)
         return CNO_ERROR(NO_MEMORY, "%zu bytes", n);
 
-    if (x->data != NULL)
+    if (x->offset) {
         memcpy(m, x->data, x->size);
-    free(x->data);
-    x->data = m;
-    x->cap  = n;
+        cno_free(x->allocator, x->data - x->offset);
+    }
+
+    x->data   = m;
+    x->cap    = n;
+    x->offset = 0;
     return CNO_OK;
 }
 
 
 static inline int cno_buffer_dyn_concat(struct cno_buffer_dyn_t *a, const struct cno_buffer_t b)
 {
-    if (b.data == NULL)
+    if (b.data == NULL || b.size == 0)
         return CNO_OK;
 
     if (cno_buffer_dyn_reserve(a, a->size + b.size))
@@ -202,6 +276,54 @@ static inline int cno_buffer_dyn_concat(struct cno_buffer_dyn_t *a, const struct
 }
 
 
+/* Unsigned LEB128 integers and length-prefixed strings, as used by `cno_connection_serialize`.
+   The `get` functions consume from the front of the buffer and fail with ASSERTION if it
+   ends too soon. */
+static inline int cno_buffer_dyn_put_uint(struct cno_buffer_dyn_t *a, uint64_t v)
+{
+    char tmp[10];
+    size_t n = 0;
+    do tmp[n++] = (char) ((v & 0x7F) | (v > 0x7F ? 0x80 : 0)); while (v >>= 7);
+    return cno_buffer_dyn_concat(a, (struct cno_buffer_t) { tmp, n });
+}
+
+
+static inline int cno_buffer_dyn_put_str(struct cno_buffer_dyn_t *a, const struct cno_buffer_t b)
+{
+    if (cno_buffer_dyn_put_uint(a, b.size))
+        return CNO_ERROR_UP();
+    return cno_buffer_dyn_concat(a, b);
+}
+
+
+static inline int cno_buffer_get_uint(struct cno_buffer_t *a, uint64_t *v)
+{
+    *v = 0;
+    for (unsigned shift = 0; a->size && shift < 64; shift += 7) {
+        uint8_t c = (uint8_t) *a->data++;
+        a->size--;
+        *v |= (uint64_t) (c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return CNO_OK;
+    }
+    return CNO_ERROR(ASSERTION, "truncated or invalid integer");
+}
+
+
+static inline int cno_buffer_get_str(struct cno_buffer_t *a, struct cno_buffer_t *out)
+{
+    uint64_t n;
+    if (cno_buffer_get_uint(a, &n))
+        return CNO_ERROR_UP();
+    if (n > a->size)
+        return CNO_ERROR(ASSERTION, "truncated string");
+    *out = (struct cno_buffer_t) { a->data, (size_t) n };
+    a->data += n;
+    a->size -= n;
+    return CNO_OK;
+}
+
+
 static inline void cno_list_gen_init(struct cno_list_t *x)
 {
     *x = (struct cno_list_t) { x, x };
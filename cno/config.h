@@ -11,16 +11,23 @@
 #define CNO_BUFFER_ALLOC_MIN_EXP 1.5
 #endif
 
-#ifndef CNO_MAX_HTTP1_HEADER_SIZE
-/* Max. length of an outbound header in HTTP/1.1 mode. If a header longer than this is
-   passed to `cno_write_message`, it will return an assertion error. Does not affect
-   inbound messages and HTTP 2. Controls stack space usage. */
-#define CNO_MAX_HTTP1_HEADER_SIZE 2048
+#ifndef CNO_ALLOC_ACCOUNTING
+/* If nonzero, count heap allocations by the function that made them and a label set
+   with `cno_alloc_set_context` (see common.h). This is a testing aid: it is slow, and
+   makes `malloc` and `realloc` macros in everything that includes common.h. */
+#define CNO_ALLOC_ACCOUNTING 0
+#endif
+
+#ifndef CNO_ERROR_TRACEBACK
+/* If zero, `cno_error()->traceback` is always empty. Saves a few stores on each
+   `CNO_ERROR_UP`, which matters if errors like WOULD_BLOCK are routinely retried. */
+#define CNO_ERROR_TRACEBACK 1
 #endif
 
 #ifndef CNO_MAX_HEADERS
-/* Max. number of entries in the header table of inbound messages. Applies to both HTTP 1
-   and HTTP 2. Does not affect outbound messages. Controls stack space usage. */
+/* Number of inbound header entries that fit on the stack. Applies to both HTTP 1
+   and HTTP 2. Does not affect outbound messages. The actual limit is `conn->max_headers`,
+   which defaults to this; messages with more headers than this use the heap. */
 #define CNO_MAX_HEADERS 64
 #endif
 
@@ -31,6 +38,13 @@
 #define CNO_MAX_CONTINUATIONS 3
 #endif
 
+#ifndef CNO_HPACK_NAME_STATS
+/* Number of buckets in the "header name hash -> dynamic table hit rate" map used by
+   the default HPACK indexing policy to avoid indexing headers that are never reused.
+   If 0, the hit rate is not tracked. Controls memory usage of each HPACK encoder/decoder. */
+#define CNO_HPACK_NAME_STATS 32
+#endif
+
 #ifndef CNO_STREAM_BUCKETS
 /* Number of buckets in the "stream id -> stream object" hash map. Must be prime to
    ensure an even distribution. Controls stack/heap usage, depending on where connection
@@ -38,9 +52,71 @@
 #define CNO_STREAM_BUCKETS 61
 #endif
 
+#ifndef CNO_STREAM_POOL
+/* Keep up to N closed stream objects per connection to reuse them instead of calling
+   malloc for each new stream. Controls heap usage of connections that are mostly idle. */
+#define CNO_STREAM_POOL 128
+#endif
+
 #ifndef CNO_STREAM_RESET_HISTORY
 /* Remember the last N streams for which RST_STREAM was sent. Frames on these streams
    will be ignored under the assumption that the other side has not seen the reset yet.
    If 0, all closed streams are assumed to be possibly-reset. */
 #define CNO_STREAM_RESET_HISTORY 7
 #endif
+
+#ifndef CNO_FLOOD_RESET_RATE
+/* How many streams per second, on average, the peer may close with RST_STREAM before
+   the connection is closed with ENHANCE_YOUR_CALM (see `conn->limit_resets`). 0 = no limit. */
+#define CNO_FLOOD_RESET_RATE 33
+#endif
+
+#ifndef CNO_FLOOD_CONTROL_RATE
+/* Same, for PING, SETTINGS, and PRIORITY frames (see `conn->limit_control`). */
+#define CNO_FLOOD_CONTROL_RATE 100
+#endif
+
+#ifndef CNO_FLOOD_EMPTY_DATA_RATE
+/* Same, for DATA frames with neither payload nor END_STREAM (see `conn->limit_empty`). */
+#define CNO_FLOOD_EMPTY_DATA_RATE 100
+#endif
+
+#ifndef CNO_FLOOD_BURST_SECONDS
+/* The above are averages: a peer that has been quiet can send this many seconds' worth
+   at once. Controls how bursty legitimate clients can be. */
+#define CNO_FLOOD_BURST_SECONDS 30
+#endif
+
+#ifndef CNO_LOOP_READ_SIZE
+/* Size of the read buffer of each cno_loop_t worker thread (see loop.h). */
+#define CNO_LOOP_READ_SIZE 65536
+#endif
+
+#ifndef CNO_LOOP_WRITE_DIRECT
+/* Writes at least this big are passed to the kernel immediately instead of being copied
+   into the connection's output buffer. */
+#define CNO_LOOP_WRITE_DIRECT 16384
+#endif
+
+#ifndef CNO_LOOP_URING_ENTRIES
+/* Size of the submission queue of each io_uring worker (see loop.h); the completion
+   queue is 4 times that. A full submission queue is simply submitted early. */
+#define CNO_LOOP_URING_ENTRIES 1024
+#endif
+
+#ifndef CNO_LOOP_URING_BUFFERS
+/* Number of receive buffers provided to the kernel by each io_uring worker. A power
+   of 2 up to 32768; if all are in use, receives are retried once some are returned. */
+#define CNO_LOOP_URING_BUFFERS 256
+#endif
+
+#ifndef CNO_LOOP_URING_BUFFER_SIZE
+/* Size of each of those buffers, i.e. the most data passed to `cno_connection_data_received`
+   at once in io_uring mode. */
+#define CNO_LOOP_URING_BUFFER_SIZE 16384
+#endif
+
+#ifndef CNO_LOOP_POOL_SIZE
+/* How many closed connections each cno_loop_t worker keeps for reuse. */
+#define CNO_LOOP_POOL_SIZE 64
+#endif
@@ -1,5 +1,5 @@
-#include <ctype.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "core.h"
 #include "../picohttpparser/picohttpparser.h"
@@ -22,6 +22,9 @@ static inline uint32_t read3(const uint8_t *p) { return read4(p) >> 8; }
 /* fake http "request" sent by the client at the beginning of a connection */
 static const struct cno_buffer_t CNO_PREFACE = { "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24 };
 
+/* prefix of `cno_connection_serialize` output; the last byte is the format version */
+static const struct cno_buffer_t CNO_SERIALIZED_MAGIC = { "cno\x02", 4 };
+
 /* standard-defined pre-initial-SETTINGS values */
 static const struct cno_settings_t CNO_SETTINGS_STANDARD = {{{ 4096, 1, -1,   65535, 16384, -1 }}};
 
@@ -29,7 +32,33 @@ static const struct cno_settings_t CNO_SETTINGS_STANDARD = {{{ 4096, 1, -1,   65
 static const struct cno_settings_t CNO_SETTINGS_CONSERVATIVE = {{{ 4096, 1, 100, 65535, 16384, -1 }}};
 
 /* actual values to send in the first SETTINGS frame */
-static const struct cno_settings_t CNO_SETTINGS_INITIAL = {{{ 4096, 1, 1024, 65535, 16384, -1 }}};
+static const struct cno_settings_t CNO_SETTINGS_INITIAL = {{{ 4096, 1, 1024, 65535, 16384, 65536 }}};
+
+
+/* take a token from the bucket; 0 if there are none left. the clock is only read when
+   the bucket is empty, so a peer that stays within the burst never causes a syscall. */
+static int cno_rate_limit_take(struct cno_rate_limit_t *b)
+{
+    if (!b->rate)
+        return 1;
+
+    if (!b->tokens) {
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        uint64_t now = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        if (now < b->time)
+            b->time = now;  // the clock went back; count from here
+        uint64_t add = (now - b->time) * b->rate / 1000;
+        if (!add)
+            return 0;
+        // keep the remainder of a partial token, unless the bucket overflows anyway.
+        b->time = add < b->burst ? b->time + add * 1000 / b->rate : now;
+        b->tokens = add < b->burst ? add : b->burst;
+    }
+
+    b->tokens--;
+    return 1;
+}
 
 
 static int cno_stream_is_local(const struct cno_connection_t *conn, uint32_t id)
@@ -46,10 +75,22 @@ static int cno_stream_is_local(const struct cno_connection_t *conn, uint32_t id)
  *
  *     INVALID_STREAM if stream id is unacceptable.
  *     WOULD_BLOCK    if this side has initiated too many streams.
- *     TRANSPORT      if the other side has initiated too many streams.
- *     NO_MEMORY      streams are heap-allocated
+ *                    (the limit on the other side's streams is up to the caller.)
+ *     NO_MEMORY      streams are heap-allocated (unless there is one in the pool)
  *
  */
+/* put a closed stream into the pool, or deallocate it if the pool is full. */
+static void cno_stream_release(struct cno_connection_t *conn, struct cno_stream_t *stream)
+{
+    if (conn->stream_pool_size < CNO_STREAM_POOL) {
+        stream->next = conn->stream_pool;
+        conn->stream_pool = stream;
+        conn->stream_pool_size++;
+    } else
+        cno_free(conn->allocator, stream);
+}
+
+
 static struct cno_stream_t * cno_stream_new(struct cno_connection_t *conn, uint32_t id, int local)
 {
     if (cno_stream_is_local(conn, id) != local)
@@ -62,12 +103,17 @@ static struct cno_stream_t * cno_stream_new(struct cno_connection_t *conn, uint3
         return CNO_ERROR_NULL(INVALID_STREAM, "HTTP/1.x has only one stream");
     }
 
-    if (conn->stream_count[local] >= conn->settings[!local].max_concurrent_streams)
-        return local ? CNO_ERROR_NULL(WOULD_BLOCK, "wait for on_stream_end")
-                     : CNO_ERROR_NULL(TRANSPORT,   "peer exceeded stream limit");
+    if (local && id > conn->goaway_recv)
+        return CNO_ERROR_NULL(DISCONNECT, "peer sent GOAWAY");
 
-    struct cno_stream_t *stream = malloc(sizeof(struct cno_stream_t));
-    if (!stream)
+    if (local && conn->stream_count[local] >= conn->settings[!local].max_concurrent_streams)
+        return CNO_ERROR_NULL(WOULD_BLOCK, "wait for on_stream_end");
+
+    struct cno_stream_t *stream = conn->stream_pool;
+    if (stream) {
+        conn->stream_pool = stream->next;
+        conn->stream_pool_size--;
+    } else if (!(stream = cno_malloc(conn->allocator, sizeof(struct cno_stream_t))))
         return CNO_ERROR_NULL(NO_MEMORY, "%zu bytes", sizeof(struct cno_stream_t));
 
     *stream = (struct cno_stream_t) {
@@ -83,7 +129,7 @@ static struct cno_stream_t * cno_stream_new(struct cno_connection_t *conn, uint3
     if (CNO_FIRE(conn, on_stream_start, id)) {
         conn->streams[id % CNO_STREAM_BUCKETS] = stream->next;
         conn->stream_count[local]--;
-        free(stream);
+        cno_stream_release(conn, stream);
         return CNO_ERROR_UP_NULL();
     }
 
@@ -107,7 +153,7 @@ static void cno_stream_free(struct cno_connection_t *conn, struct cno_stream_t *
     while (*s != stream) s = &(*s)->next;
     *s = stream->next;
 
-    free(stream);
+    cno_stream_release(conn, stream);
 }
 
 
@@ -198,12 +244,22 @@ static int cno_frame_write_settings(const struct cno_connection_t *conn,
 }
 
 
-static int cno_stream_rst_by_local(struct cno_connection_t *conn, struct cno_stream_t *stream)
+/* so that frames the peer sent before it knew about the reset are ignored. */
+static void cno_stream_remember_reset(struct cno_connection_t *conn, uint32_t id)
 {
 #if CNO_STREAM_RESET_HISTORY
-    conn->recently_reset[conn->recently_reset_next++] = stream->id;
+    conn->recently_reset[conn->recently_reset_next++] = id;
     conn->recently_reset_next %= CNO_STREAM_RESET_HISTORY;
+#else
+    (void) conn;
+    (void) id;
 #endif
+}
+
+
+static int cno_stream_rst_by_local(struct cno_connection_t *conn, struct cno_stream_t *stream)
+{
+    cno_stream_remember_reset(conn, stream->id);
     return cno_stream_rst(conn, stream);
 }
 
@@ -233,7 +289,7 @@ static int cno_frame_write_rst_stream(struct cno_connection_t *conn,
 static int cno_frame_write_goaway(struct cno_connection_t *conn,
                                   uint32_t /* enum CNO_RST_STREAM_CODE */ code)
 {
-    if (conn->goaway_sent)
+    if (!conn->goaway_sent)
         conn->goaway_sent = conn->last_stream[CNO_REMOTE];
     struct cno_frame_t error = { CNO_FRAME_GOAWAY, 0, 0, { PACK(I32(conn->goaway_sent), I32(code)) } };
     return cno_frame_write(conn, &error);
@@ -283,8 +339,11 @@ static int cno_frame_handle_message(struct cno_connection_t *conn,
             // >Pseudo-header fields MUST NOT appear in trailers.
             goto invalid_message;
 
+        if (cno_header_value_is_invalid(it->value))
+            goto invalid_message;
+
         if (is_response) {
-            if (cno_buffer_eq(it->name, CNO_BUFFER_STRING(":status"))) {
+            if (it->token == CNO_TOKEN_STATUS) {
                 if (msg->code)
                     goto invalid_message;
                 for (const char *p = it->value.data; p != it->value.data + it->value.size; p++) {
@@ -295,24 +354,24 @@ static int cno_frame_handle_message(struct cno_connection_t *conn,
                 continue;
             }
         } else {
-            if (cno_buffer_eq(it->name, CNO_BUFFER_STRING(":path"))) {
+            if (it->token == CNO_TOKEN_PATH) {
                 if (msg->path.data)
                     goto invalid_message;
                 msg->path = it->value;
                 continue;
             }
 
-            if (cno_buffer_eq(it->name, CNO_BUFFER_STRING(":method"))) {
+            if (it->token == CNO_TOKEN_METHOD) {
                 if (msg->method.data)
                     goto invalid_message;
                 msg->method = it->value;
                 continue;
             }
 
-            if (cno_buffer_eq(it->name, CNO_BUFFER_STRING(":authority")))
+            if (it->token == CNO_TOKEN_AUTHORITY)
                 goto save_header;
 
-            if (cno_buffer_eq(it->name, CNO_BUFFER_STRING(":scheme"))) {
+            if (it->token == CNO_TOKEN_SCHEME) {
                 if (has_scheme)
                     goto invalid_message;
                 has_scheme = 1;
@@ -345,9 +404,13 @@ static int cno_frame_handle_message(struct cno_connection_t *conn,
 
         // >However, header field names MUST be converted to lowercase
         // >prior to their encoding in HTTP/2.
-        for (const char *p = it->name.data; p != it->name.data + it->name.size; p++)
-            if ('A' <= *p && *p <= 'Z')
-                goto invalid_message;
+        if (cno_header_name_has_uppercase(it->name))
+            goto invalid_message;
+
+        // >A field value MUST NOT contain the zero value (ASCII NUL, 0x00), line feed
+        // >(ASCII LF, 0x0a), or carriage return (ASCII CR, 0x0d) at any position.
+        if (cno_header_value_is_invalid(it->value))
+            goto invalid_message;
 
         // TODO
         // >HTTP/2 does not use the Connection header field to indicate
@@ -397,33 +460,121 @@ invalid_message:
 }
 
 
+/* Receives headers from the HPACK decoder. Pseudo-headers are collected into an array (on
+   the stack, or in `conn->headers` if there are more than CNO_MAX_HEADERS); so are regular
+   ones, unless there is an `on_header` callback to take them right away. */
+struct cno_header_sink_t
+{
+    struct cno_connection_t *conn;
+    uint32_t stream;  // to pass to `on_header`; 0 if regular headers should be collected too
+    uint8_t  regular;  // whether a regular header has been seen yet
+    uint8_t  invalid;
+    uint8_t  failed;  // `on_header` or an allocation did
+    size_t count;
+    size_t cap;
+    struct cno_header_t *headers;
+};
+
+
+static int cno_header_sink_add(void *data, const struct cno_header_t *h)
+{
+    struct cno_header_sink_t *sink = data;
+    struct cno_connection_t *conn = sink->conn;
+
+    if (sink->stream && !cno_buffer_startswith(h->name, CNO_BUFFER_STRING(":"))) {
+        // same checks as in `cno_frame_handle_message`, but done one header at a time.
+        sink->regular = 1;
+        if (cno_header_name_has_uppercase(h->name) || cno_header_value_is_invalid(h->value))
+            sink->invalid = 1;
+        if (sink->invalid)
+            return CNO_OK;  // but keep decoding to stay in sync
+        if (CNO_FIRE(conn, on_header, sink->stream, h)) {
+            sink->failed = 1;
+            return CNO_ERROR_UP();
+        }
+        return CNO_OK;
+    }
+
+    if (sink->regular)
+        // >All pseudo-header fields MUST appear in the header block before regular header fields.
+        sink->invalid = 1;
+
+    if (sink->count == sink->cap) {
+        size_t cap = sink->cap * 2;
+        int spilled = sink->headers == (struct cno_header_t *) conn->headers.data;
+        conn->headers.size = spilled ? sink->count * sizeof(*h) : 0;
+        if (cno_buffer_dyn_reserve(&conn->headers, cap * sizeof(*h))) {
+            sink->failed = 1;
+            return CNO_ERROR_UP();
+        }
+        if (!spilled)
+            memcpy(conn->headers.data, sink->headers, sink->count * sizeof(*h));
+        sink->headers = (struct cno_header_t *) conn->headers.data;
+        sink->cap = cap;
+    }
+
+    sink->headers[sink->count++] = *h;
+    return CNO_OK;
+}
+
+
+/* block:: either the payload of the current frame, or all of them concatenated in `continued`. */
 static int cno_frame_handle_end_headers(struct cno_connection_t *conn,
                                         struct cno_stream_t     *stream,
-                                        struct cno_frame_t      *frame)
+                                        struct cno_frame_t      *frame,
+                                        struct cno_buffer_t      block)
 {
     struct cno_header_t headers[CNO_MAX_HEADERS];
-    size_t count = CNO_MAX_HEADERS;
+    struct cno_header_sink_t sink = { conn, 0, 0, 0, 0, 0, CNO_MAX_HEADERS, headers };
+    if (conn->on_header && !(stream->accept & CNO_ACCEPT_NOP_HEADERS))
+        sink.stream = conn->continued_promise ? conn->continued_promise : stream->id;
+
+    int failed = cno_hpack_decode_each(&conn->decoder, block, conn->max_headers, &cno_header_sink_add, &sink);
+    conn->headers.size = 0;
 
-    if (cno_hpack_decode(&conn->decoder, conn->continued.as_static, headers, &count)) {
+    if (failed && (sink.failed || cno_error_code() != CNO_ERRNO_TOO_LARGE)) {
         cno_buffer_dyn_clear(&conn->continued);
-        cno_frame_write_goaway(conn, CNO_RST_COMPRESSION_ERROR);
+        if (!sink.failed)
+            cno_frame_write_goaway(conn, CNO_RST_COMPRESSION_ERROR);
         return CNO_ERROR_UP();
     }
 
-    struct cno_message_t msg = { 0, CNO_BUFFER_EMPTY, CNO_BUFFER_EMPTY, headers, count };
-    int failed = cno_frame_handle_message(conn, stream, frame, &msg);
-
-    for (size_t i = 0; i < count; i++)
-        cno_hpack_free_header(&headers[i]);
+    if (failed || sink.invalid) {
+        cno_buffer_dyn_clear(&conn->continued);
+        // the decoder is still in sync, so only this stream (or the promised one) has to go.
+        if (conn->continued_promise)
+            stream = cno_stream_find(conn, conn->continued_promise);
+        conn->continued_stream  = 0;
+        conn->continued_promise = 0;
+        stream->accept &= ~CNO_ACCEPT_HEADERS;
+        return cno_frame_write_rst_stream(conn, stream, CNO_RST_PROTOCOL_ERROR);
+    }
 
+    struct cno_message_t msg = { 0, CNO_BUFFER_EMPTY, CNO_BUFFER_EMPTY, sink.headers, sink.count, NULL };
+    failed = cno_frame_handle_message(conn, stream, frame, &msg);
     cno_buffer_dyn_clear(&conn->continued);
-    conn->continued = CNO_BUFFER_DYN_EMPTY;
     conn->continued_stream  = 0;
     conn->continued_promise = 0;
     return failed;
 }
 
 
+/* decode a header block that nobody is going to see, only to keep the decoder in sync. */
+static int cno_frame_discard_headers(struct cno_connection_t *conn, struct cno_buffer_t block)
+{
+    // with a limit of 0, every header is skipped over and the callback is never called.
+    int failed = cno_hpack_decode_each(&conn->decoder, block, 0, NULL, NULL);
+    cno_buffer_dyn_clear(&conn->continued);
+    conn->continued_stream = 0;
+
+    if (failed && cno_error_code() != CNO_ERRNO_TOO_LARGE) {
+        cno_frame_write_goaway(conn, CNO_RST_COMPRESSION_ERROR);
+        return CNO_ERROR_UP();
+    }
+    return CNO_OK;
+}
+
+
 static int cno_frame_handle_padding(struct cno_connection_t *conn, struct cno_frame_t *frame)
 {
     if (frame->flags & CNO_FLAG_PADDED) {
@@ -458,6 +609,50 @@ static int cno_frame_handle_priority_prefix(struct cno_connection_t *conn,
 }
 
 
+/* >An endpoint that receives a HEADERS frame that causes its advertised concurrent
+   >stream limit to be exceeded MUST treat this as a stream error of type PROTOCOL_ERROR
+   >or REFUSED_STREAM. [RFC 7540, 5.1.2]
+   the peer may not have received a lowered limit yet, and can retry a refused stream.
+   this has to be cheap, so no stream is allocated and the application is not told; the
+   header block (see `cno_frame_handle_continuation` for the rest) is only decoded to keep
+   the decoder in sync. */
+static int cno_frame_handle_refused_headers(struct cno_connection_t *conn,
+                                            struct cno_frame_t      *frame)
+{
+    if (!cno_rate_limit_take(&conn->limit_resets))
+        return cno_frame_write_error(conn, CNO_RST_ENHANCE_YOUR_CALM, "peer exceeded stream limit");
+
+    // same checks as in `cno_stream_new`.
+    if (cno_stream_is_local(conn, frame->stream))
+        return CNO_ERROR(INVALID_STREAM, "incorrect parity");
+
+    if (frame->stream <= conn->last_stream[CNO_REMOTE])
+        return CNO_ERROR(INVALID_STREAM, "nonmonotonic");
+
+    conn->last_stream[CNO_REMOTE] = frame->stream;
+    cno_stream_remember_reset(conn, frame->stream);
+
+    struct cno_frame_t error = { CNO_FRAME_RST_STREAM, 0, frame->stream, { PACK(I32(CNO_RST_REFUSED_STREAM)) } };
+    if (cno_frame_write(conn, &error))
+        return CNO_ERROR_UP();
+
+    if (frame->flags & CNO_FLAG_PRIORITY) {
+        if (frame->payload.size < 5)
+            return cno_frame_write_error(conn, CNO_RST_FRAME_SIZE_ERROR, "no priority spec");
+
+        frame->payload.data += 5;
+        frame->payload.size -= 5;
+    }
+
+    if (frame->flags & CNO_FLAG_END_HEADERS)
+        return cno_frame_discard_headers(conn, frame->payload);
+
+    conn->continued_flags = 0;
+    conn->continued_stream = frame->stream;
+    return cno_buffer_dyn_concat(&conn->continued, frame->payload);
+}
+
+
 static int cno_frame_handle_headers(struct cno_connection_t *conn,
                                     struct cno_stream_t     *stream,
                                     struct cno_frame_t      *frame)
@@ -470,6 +665,9 @@ static int cno_frame_handle_headers(struct cno_connection_t *conn,
             // servers cannot initiate streams.
             return cno_frame_write_error(conn, CNO_RST_PROTOCOL_ERROR, "unexpected HEADERS");
 
+        if (conn->stream_count[CNO_REMOTE] >= conn->settings[CNO_LOCAL].max_concurrent_streams)
+            return cno_frame_handle_refused_headers(conn, frame);
+
         stream = cno_stream_new(conn, frame->stream, CNO_REMOTE);
         if (stream == NULL)
             return CNO_ERROR_UP();
@@ -500,14 +698,15 @@ static int cno_frame_handle_headers(struct cno_connection_t *conn,
     conn->continued_flags = frame->flags & CNO_FLAG_END_STREAM;
     conn->continued_stream = stream->id;
 
+    if (frame->flags & CNO_FLAG_END_HEADERS)
+        // the usual case: the whole block is in this frame, so there is nothing to concatenate.
+        return cno_frame_handle_end_headers(conn, stream, frame, frame->payload);
+
     if (cno_buffer_dyn_concat(&conn->continued, frame->payload))
         // no need to cleanup -- compression errors are non-recoverable,
         // everything will be destroyed along with the connection.
         return CNO_ERROR_UP();
 
-    if (frame->flags & CNO_FLAG_END_HEADERS)
-        return cno_frame_handle_end_headers(conn, stream, frame);
-
     return CNO_OK;
 }
 
@@ -527,6 +726,9 @@ static int cno_frame_handle_push_promise(struct cno_connection_t *conn,
 
     uint32_t promised = read4((const uint8_t *) frame->payload.data);
 
+    if (conn->stream_count[CNO_REMOTE] >= conn->settings[CNO_LOCAL].max_concurrent_streams)
+        return CNO_ERROR(TRANSPORT, "peer exceeded stream limit");
+
     struct cno_stream_t *child = cno_stream_new(conn, promised, CNO_REMOTE);
     if (child == NULL)
         return CNO_ERROR_UP();
@@ -536,13 +738,14 @@ static int cno_frame_handle_push_promise(struct cno_connection_t *conn,
     conn->continued_stream = stream->id;
     conn->continued_promise = promised;
 
-    if (cno_buffer_dyn_concat(&conn->continued, (struct cno_buffer_t) { frame->payload.data + 4,
-                                                                        frame->payload.size - 4 }))
-        // a compression error. unrecoverable.
-        return CNO_ERROR_UP();
+    struct cno_buffer_t block = { frame->payload.data + 4, frame->payload.size - 4 };
 
     if (frame->flags & CNO_FLAG_END_HEADERS)
-        return cno_frame_handle_end_headers(conn, child, frame);
+        return cno_frame_handle_end_headers(conn, child, frame, block);
+
+    if (cno_buffer_dyn_concat(&conn->continued, block))
+        // a compression error. unrecoverable.
+        return CNO_ERROR_UP();
     return CNO_OK;
 }
 
@@ -551,7 +754,7 @@ static int cno_frame_handle_continuation(struct cno_connection_t *conn,
                                          struct cno_stream_t     *stream,
                                          struct cno_frame_t      *frame)
 {
-    if (!stream || !conn->continued_stream)
+    if (!conn->continued_stream)
         return cno_frame_write_error(conn, CNO_RST_PROTOCOL_ERROR, "unexpected CONTINUATION");
 
     // we don't actually count CONTINUATIONs, but this is an ok estimate.
@@ -564,9 +767,14 @@ static int cno_frame_handle_continuation(struct cno_connection_t *conn,
         return CNO_ERROR_UP();
 
     frame->flags |= conn->continued_flags;
-    if (frame->flags & CNO_FLAG_END_HEADERS)
-        return cno_frame_handle_end_headers(conn, stream, frame);
-    return CNO_OK;
+    if (!(frame->flags & CNO_FLAG_END_HEADERS))
+        return CNO_OK;
+
+    if (!stream)
+        // the stream was refused by `cno_frame_handle_refused_headers`.
+        return cno_frame_discard_headers(conn, conn->continued.as_static);
+
+    return cno_frame_handle_end_headers(conn, stream, frame, conn->continued.as_static);
 }
 
 
@@ -595,6 +803,9 @@ static int cno_frame_handle_data(struct cno_connection_t *conn,
     if (cno_frame_handle_padding(conn, frame))
         return CNO_ERROR_UP();
 
+    if (!frame->payload.size && !(frame->flags & CNO_FLAG_END_STREAM) && !cno_rate_limit_take(&conn->limit_empty))
+        return cno_frame_write_error(conn, CNO_RST_ENHANCE_YOUR_CALM, "too many empty DATA frames");
+
     if (length) {
         // TODO allow manual connection flow control?
         struct cno_frame_t update = { CNO_FRAME_WINDOW_UPDATE, 0, 0, { PACK(I32(length)) } };
@@ -633,6 +844,9 @@ static int cno_frame_handle_ping(struct cno_connection_t *conn,
     if (frame->payload.size != 8)
         return cno_frame_write_error(conn, CNO_RST_FRAME_SIZE_ERROR, "bad PING frame");
 
+    if (!cno_rate_limit_take(&conn->limit_control))
+        return cno_frame_write_error(conn, CNO_RST_ENHANCE_YOUR_CALM, "too many PINGs");
+
     if (frame->flags & CNO_FLAG_ACK)
         return CNO_FIRE(conn, on_pong, frame->payload.data);
 
@@ -651,11 +865,32 @@ static int cno_frame_handle_goaway(struct cno_connection_t *conn,
     if (frame->payload.size < 8)
         return cno_frame_write_error(conn, CNO_RST_FRAME_SIZE_ERROR, "bad GOAWAY");
 
+    const uint32_t last  = read4((const uint8_t *) frame->payload.data) & 0x7FFFFFFFUL;
     const uint32_t error = read4((const uint8_t *) frame->payload.data + 4);
+    if (conn->goaway_recv > last)
+        conn->goaway_recv = last;
+
+    // the peer has not processed these streams and never will, whatever the error code,
+    // so they can be retried on another connection. `on_stream_end` may touch other
+    // streams, so rescan each time.
+    for (size_t i = 0; i < CNO_STREAM_BUCKETS;) {
+        struct cno_stream_t *s = conn->streams[i];
+        while (s && (s->id <= conn->goaway_recv || !cno_stream_is_local(conn, s->id)))
+            s = s->next;
+        if (!s)
+            i++;
+        else if (cno_stream_rst_by_local(conn, s))
+            return CNO_ERROR_UP();
+    }
+
     if (error != CNO_RST_NO_ERROR)
         return CNO_ERROR(TRANSPORT, "disconnected with error %u", error);
-    // TODO: clean shutdown: reject all streams higher than indicated in the frame
-    return CNO_ERROR(DISCONNECT, "disconnected");
+
+    // the rest are allowed to complete; `cno_connection_data_received` will fail
+    // with DISCONNECT once they have.
+    if (!conn->stream_count[CNO_LOCAL] && !conn->stream_count[CNO_REMOTE])
+        return CNO_ERROR(DISCONNECT, "disconnected");
+    return CNO_OK;
 }
 
 
@@ -669,7 +904,12 @@ static int cno_frame_handle_rst_stream(struct cno_connection_t *conn,
     if (frame->payload.size != 4)
         return cno_frame_write_error(conn, CNO_RST_FRAME_SIZE_ERROR, "bad RST_STREAM");
 
-    // TODO parse the error code and do something with it.
+    if (!cno_rate_limit_take(&conn->limit_resets))
+        return cno_frame_write_error(conn, CNO_RST_ENHANCE_YOUR_CALM, "too many RST_STREAMs");
+
+    const uint32_t error = read4((const uint8_t *) frame->payload.data);
+    if (CNO_FIRE(conn, on_stream_reset, stream->id, error))
+        return CNO_ERROR_UP();
     return cno_stream_rst(conn, stream);
 }
 
@@ -684,6 +924,9 @@ static int cno_frame_handle_priority(struct cno_connection_t *conn,
     if (frame->payload.size != 5)
         return cno_frame_write_error(conn, CNO_RST_FRAME_SIZE_ERROR, "bad PRIORITY");
 
+    if (!cno_rate_limit_take(&conn->limit_control))
+        return cno_frame_write_error(conn, CNO_RST_ENHANCE_YOUR_CALM, "too many PRIORITYs");
+
     return cno_frame_handle_priority_prefix(conn, stream, frame);
 }
 
@@ -695,6 +938,9 @@ static int cno_frame_handle_settings(struct cno_connection_t *conn,
     if (frame->stream)
         return cno_frame_write_error(conn, CNO_RST_PROTOCOL_ERROR, "SETTINGS on a stream");
 
+    if (!cno_rate_limit_take(&conn->limit_control))
+        return cno_frame_write_error(conn, CNO_RST_ENHANCE_YOUR_CALM, "too many SETTINGS");
+
     if (frame->flags & CNO_FLAG_ACK) {
         if (frame->payload.size)
             return cno_frame_write_error(conn, CNO_RST_FRAME_SIZE_ERROR, "bad SETTINGS ack");
@@ -755,8 +1001,13 @@ static int cno_frame_handle_window_update(struct cno_connection_t *conn,
 
         conn->window_send += increment;
     } else {
+        // >WINDOW_UPDATE can be sent by a peer that has sent a frame bearing the
+        // >END_STREAM flag. This means that a receiver could receive a WINDOW_UPDATE
+        // >frame on a "half-closed (remote)" or "closed" stream. A receiver MUST NOT
+        // >treat this as an error.
         if (stream == NULL)
-            return cno_frame_handle_invalid_stream(conn, frame);
+            return frame->stream <= conn->last_stream[cno_stream_is_local(conn, frame->stream)]
+                 ? CNO_OK : cno_frame_handle_invalid_stream(conn, frame);
 
         if (stream->window_send > 0x7fffffffL - (int32_t) increment)
             return cno_frame_write_rst_stream(conn, stream, CNO_RST_FLOW_CONTROL_ERROR);
@@ -817,12 +1068,61 @@ int cno_connection_set_config(struct cno_connection_t *conn, const struct cno_se
 
     memcpy(&conn->settings[CNO_LOCAL], settings, sizeof(*settings));
     conn->decoder.limit_upper = settings->header_table_size;
+    conn->decoder.limit_list = settings->max_header_list_size;
+    conn->header_table_size = settings->header_table_size;
     // TODO the difference in initial flow control window size should be subtracted
     //      from the flow control window size of all active streams.
     return CNO_OK;
 }
 
 
+int cno_connection_adjust_streams(struct cno_connection_t *conn, const struct cno_stream_limit_t *cfg, double load)
+{
+    if (!cno_connection_is_http2(conn))
+        return CNO_OK;  // one stream at a time anyway
+
+    // additive increase, multiplicative decrease -- proportional to the overload, up to `backoff`.
+    struct cno_settings_t settings = conn->settings[CNO_LOCAL];
+    double limit = load > 1 ? settings.max_concurrent_streams * (1 / load > cfg->backoff ? 1 / load : cfg->backoff)
+                            : (double) settings.max_concurrent_streams + cfg->step;
+    settings.max_concurrent_streams = limit < cfg->min ? cfg->min : limit > cfg->max ? cfg->max : (uint32_t) limit;
+    if (settings.max_concurrent_streams == conn->settings[CNO_LOCAL].max_concurrent_streams)
+        return CNO_OK;
+
+    uint32_t configured = conn->header_table_size;
+    if (cno_connection_set_config(conn, &settings))
+        return CNO_ERROR_UP();
+    conn->header_table_size = configured;
+    return CNO_OK;
+}
+
+
+/* move the sizes of both HPACK tables towards what `conn->hpack_budget` allows. */
+static int cno_connection_govern(struct cno_connection_t *conn)
+{
+    const struct cno_hpack_budget_t *budget = conn->hpack_budget;
+    if (!budget || !cno_connection_is_http2(conn))
+        return CNO_OK;
+
+    // the encoder's table can be any size up to what the peer allows...
+    uint32_t limit = cno_hpack_budget_target(budget, conn->encoder.limit_update_end, conn->encoder.limit_upper);
+    if (limit != conn->encoder.limit_update_end)
+        cno_hpack_setlimit(&conn->encoder, limit);
+
+    // ...while the decoder's is chosen by the peer, up to what we advertise.
+    struct cno_settings_t settings = conn->settings[CNO_LOCAL];
+    settings.header_table_size = cno_hpack_budget_target(budget, settings.header_table_size, conn->header_table_size);
+    if (settings.header_table_size == conn->settings[CNO_LOCAL].header_table_size)
+        return CNO_OK;
+
+    uint32_t configured = conn->header_table_size;
+    if (cno_connection_set_config(conn, &settings))
+        return CNO_ERROR_UP();
+    conn->header_table_size = configured;
+    return CNO_OK;
+}
+
+
 void cno_connection_init(struct cno_connection_t *conn, enum CNO_CONNECTION_KIND kind)
 {
     *conn = (struct cno_connection_t) {
@@ -832,10 +1132,36 @@ void cno_connection_init(struct cno_connection_t *conn, enum CNO_CONNECTION_KIND
         .window_send = CNO_SETTINGS_STANDARD.initial_window_size,
         .settings    = { /* remote = */ CNO_SETTINGS_CONSERVATIVE,
                          /* local  = */ CNO_SETTINGS_INITIAL, },
+        .header_table_size = CNO_SETTINGS_INITIAL.header_table_size,
+        .max_headers = CNO_MAX_HEADERS,
+        .goaway_recv = -1,
+        .limit_resets  = { CNO_FLOOD_RESET_RATE,      CNO_FLOOD_RESET_RATE      * CNO_FLOOD_BURST_SECONDS, 0, 0 },
+        .limit_control = { CNO_FLOOD_CONTROL_RATE,    CNO_FLOOD_CONTROL_RATE    * CNO_FLOOD_BURST_SECONDS, 0, 0 },
+        .limit_empty   = { CNO_FLOOD_EMPTY_DATA_RATE, CNO_FLOOD_EMPTY_DATA_RATE * CNO_FLOOD_BURST_SECONDS, 0, 0 },
     };
 
     cno_hpack_init(&conn->decoder, CNO_SETTINGS_INITIAL .header_table_size);
     cno_hpack_init(&conn->encoder, CNO_SETTINGS_STANDARD.header_table_size);
+    conn->decoder.limit_list = CNO_SETTINGS_INITIAL.max_header_list_size;
+}
+
+
+/* free the buffers that hold nothing at the moment, and all pooled streams. */
+static void cno_connection_release(struct cno_connection_t *conn)
+{
+    if (!conn->buffer.size)
+        cno_buffer_dyn_clear(&conn->buffer);
+    if (!conn->continued.size)
+        cno_buffer_dyn_clear(&conn->continued);
+    cno_buffer_dyn_clear(&conn->output);
+    cno_buffer_dyn_clear(&conn->headers);
+    cno_hpack_release(&conn->decoder);
+
+    for (struct cno_stream_t *next; conn->stream_pool; conn->stream_pool = next) {
+        next = conn->stream_pool->next;
+        cno_free(conn->allocator, conn->stream_pool);
+    }
+    conn->stream_pool_size = 0;
 }
 
 
@@ -843,12 +1169,37 @@ void cno_connection_reset(struct cno_connection_t *conn)
 {
     cno_buffer_dyn_clear(&conn->buffer);
     cno_buffer_dyn_clear(&conn->continued);
+    cno_buffer_dyn_clear(&conn->output);
+    cno_buffer_dyn_clear(&conn->headers);
     cno_hpack_clear(&conn->encoder);
     cno_hpack_clear(&conn->decoder);
+    cno_hpack_set_budget(&conn->encoder, NULL);
+    cno_hpack_set_budget(&conn->decoder, NULL);
 
     for (int i = 0; i < CNO_STREAM_BUCKETS; i++)
         while (conn->streams[i])
             cno_stream_free(conn, conn->streams[i]);
+
+    cno_connection_release(conn);
+}
+
+
+int cno_connection_shrink(struct cno_connection_t *conn, uint32_t header_table_size)
+{
+    cno_connection_release(conn);
+
+    // the encoder's table is ours to drop; the next header block will tell the peer
+    // to do the same, then restore the limit so that the table can be refilled.
+    uint32_t limit = conn->encoder.limit_update_end;
+    cno_hpack_setlimit(&conn->encoder, 0);
+    cno_hpack_setlimit(&conn->encoder, limit);
+
+    // the decoder's table belongs to the peer's encoder, which can only be asked to shrink it.
+    if (header_table_size >= conn->settings[CNO_LOCAL].header_table_size)
+        return CNO_OK;
+    struct cno_settings_t settings = conn->settings[CNO_LOCAL];
+    settings.header_table_size = header_table_size;
+    return cno_connection_set_config(conn, &settings);
 }
 
 
@@ -862,6 +1213,22 @@ int cno_connection_is_http2(struct cno_connection_t *conn)
 }
 
 
+static int cno_http1_parse(struct cno_connection_t *conn, struct cno_message_t *msg, int *minor,
+                           struct phr_header *headers, size_t max)
+{
+    msg->headers_len = max;
+    return conn->client
+      ? phr_parse_response(conn->buffer.data, conn->buffer.size, minor, &msg->code,
+            &msg->method.data, &msg->method.size,
+            headers, &msg->headers_len, 1)
+
+      : phr_parse_request(conn->buffer.data, conn->buffer.size,
+            &msg->method.data, &msg->method.size,
+            &msg->path.data, &msg->path.size,
+            minor, headers, &msg->headers_len, 1);
+}
+
+
 static int cno_connection_upgrade(struct cno_connection_t *conn)
 {
     if (conn->client && CNO_FIRE(conn, on_write, CNO_PREFACE.data, CNO_PREFACE.size))
@@ -873,7 +1240,7 @@ static int cno_connection_upgrade(struct cno_connection_t *conn)
 
 static int cno_connection_proceed(struct cno_connection_t *conn)
 {
-    while (1) switch (conn->state) {
+    while (!(conn->flags & CNO_CONN_FLAG_PAUSED)) switch (conn->state) {
         case CNO_CONNECTION_UNDEFINED: {
             return CNO_OK;  // wait until connection_made before processing data
         }
@@ -920,19 +1287,29 @@ static int cno_connection_proceed(struct cno_connection_t *conn)
                 break;
             }
 
-            struct cno_message_t msg = { 0, CNO_BUFFER_EMPTY, CNO_BUFFER_EMPTY, NULL, CNO_MAX_HEADERS };
-            struct phr_header headers_phr[CNO_MAX_HEADERS];
+            struct cno_message_t msg = { 0, CNO_BUFFER_EMPTY, CNO_BUFFER_EMPTY, NULL, 0, NULL };
+            struct phr_header headers_phr_stack[CNO_MAX_HEADERS];
+            struct phr_header *headers_phr = headers_phr_stack;
+            struct cno_header_t headers_stack[CNO_MAX_HEADERS + 1];
+            struct cno_header_t *headers = headers_stack;
 
             int minor;
-            int ok = conn->client
-              ? phr_parse_response(conn->buffer.data, conn->buffer.size, &minor, &msg.code,
-                    &msg.method.data, &msg.method.size,
-                    headers_phr, &msg.headers_len, 1)
-
-              : phr_parse_request(conn->buffer.data, conn->buffer.size,
-                    &msg.method.data, &msg.method.size,
-                    &msg.path.data, &msg.path.size,
-                    &minor, headers_phr, &msg.headers_len, 1);
+            size_t limit = conn->max_headers < CNO_MAX_HEADERS ? conn->max_headers : CNO_MAX_HEADERS;
+            int ok = cno_http1_parse(conn, &msg, &minor, headers_phr, limit);
+
+            if (ok == -1 && conn->max_headers > CNO_MAX_HEADERS) {
+                // picohttpparser does not say why it failed; maybe there were too many headers.
+                // `conn->headers` fits both arrays: cno headers first, then the parser's.
+                size_t n = conn->max_headers;
+                if (cno_buffer_dyn_reserve(&conn->headers, (n + 1) * sizeof(*headers) + n * sizeof(*headers_phr)))
+                    return CNO_ERROR_UP();
+                headers = (struct cno_header_t *) conn->headers.data;
+                headers_phr = (struct phr_header *) &headers[n + 1];
+                ok = cno_http1_parse(conn, &msg, &minor, headers_phr, n);
+            } else if (ok == -1 && limit < CNO_MAX_HEADERS) {
+                // same, but the stack arrays are big enough to tell for sure.
+                ok = cno_http1_parse(conn, &msg, &minor, headers_phr, CNO_MAX_HEADERS);
+            }
 
             if (ok == -2) {
                 if (conn->buffer.size > CNO_MAX_CONTINUATIONS * conn->settings[CNO_LOCAL].max_frame_size)
@@ -943,15 +1320,17 @@ static int cno_connection_proceed(struct cno_connection_t *conn)
             if (ok == -1)
                 return CNO_ERROR(TRANSPORT, "bad HTTP/1.x message");
 
+            if (msg.headers_len > conn->max_headers)
+                return CNO_ERROR(TRANSPORT, "too many headers");
+
             if (minor != 0 && minor != 1)
                 return CNO_ERROR(TRANSPORT, "HTTP/1.%d not supported", minor);
 
             if (!conn->client)
                 msg.headers_len++; // for :scheme
-            struct cno_header_t headers[msg.headers_len];
             struct cno_header_t *it = msg.headers = headers;
             if (!conn->client)
-                *it++ = (struct cno_header_t) { CNO_BUFFER_STRING(":scheme"), CNO_BUFFER_STRING("unknown"), 0 };
+                *it++ = (struct cno_header_t) { CNO_BUFFER_STRING(":scheme"), CNO_BUFFER_STRING("unknown"), 0, CNO_TOKEN_SCHEME };
 
             conn->http1_remaining = 0;
 
@@ -959,20 +1338,17 @@ static int cno_connection_proceed(struct cno_connection_t *conn)
                 *it = (struct cno_header_t) {
                     { headers_phr[i].name,  headers_phr[i].name_len  },
                     { headers_phr[i].value, headers_phr[i].value_len },
-                    0
+                    0, 0
                 };
 
-                {
-                    char * ptr = (char *) it->name.data;
-                    char * end = (char *) it->name.data + it->name.size;
-                    for (; ptr != end; ptr++) *ptr = tolower(*ptr);
-                }
+                cno_header_name_lowercase((char *) it->name.data, it->name.size);
+                it->token = cno_header_token(it->name);
 
-                if (cno_buffer_eq(it->name, CNO_BUFFER_STRING("http2-settings"))) {
+                if (it->token == CNO_TOKEN_HTTP2_SETTINGS) {
                     // TODO decode & emit on_frame
                 } else
 
-                if (cno_buffer_eq(it->name, CNO_BUFFER_STRING("upgrade"))) {
+                if (it->token == CNO_TOKEN_UPGRADE) {
                     if (conn->state != CNO_CONNECTION_HTTP1_READY)
                         continue;
 
@@ -993,10 +1369,10 @@ static int cno_connection_proceed(struct cno_connection_t *conn)
                         continue;
 
                     struct cno_header_t upgrade_headers[] = {
-                        { CNO_BUFFER_STRING("connection"), CNO_BUFFER_STRING("upgrade"), 0 },
-                        { CNO_BUFFER_STRING("upgrade"),    CNO_BUFFER_STRING("h2c"),     0 },
+                        { CNO_BUFFER_STRING("connection"), CNO_BUFFER_STRING("upgrade"), 0, CNO_TOKEN_CONNECTION },
+                        { CNO_BUFFER_STRING("upgrade"),    CNO_BUFFER_STRING("h2c"),     0, CNO_TOKEN_UPGRADE },
                     };
-                    struct cno_message_t upgrade_msg = { 101, CNO_BUFFER_EMPTY, CNO_BUFFER_EMPTY, upgrade_headers, 2 };
+                    struct cno_message_t upgrade_msg = { 101, CNO_BUFFER_EMPTY, CNO_BUFFER_EMPTY, upgrade_headers, 2, NULL };
                     // if we send the preface now, we'll be able to send HTTP 2 frames
                     // while in the HTTP1_READING_UPGRADE state.
                     if (cno_write_message(conn, 1, &upgrade_msg, 1) || cno_connection_upgrade(conn))
@@ -1015,7 +1391,7 @@ static int cno_connection_proceed(struct cno_connection_t *conn)
                     continue;
                 } else
 
-                if (cno_buffer_eq(it->name, CNO_BUFFER_STRING("content-length"))) {
+                if (it->token == CNO_TOKEN_CONTENT_LENGTH) {
                     // 3. content-length is unique, and mutually exclusive with transfer-encoding
                     if (conn->http1_remaining)
                         return CNO_ERROR(TRANSPORT, "bad HTTP/1.x message: multiple content-lengths");
@@ -1026,15 +1402,16 @@ static int cno_connection_proceed(struct cno_connection_t *conn)
                     }
                 } else
 
-                if (cno_buffer_eq(it->name, CNO_BUFFER_STRING("transfer-encoding"))) {
+                if (it->token == CNO_TOKEN_TRANSFER_ENCODING) {
                     // 4. any non-identity transfer-encoding requires chunked (which should also be
                     //    listed; we don't check for that and simply fail on parsing the format instead)
                     if (!cno_buffer_eq(it->value, CNO_BUFFER_STRING("identity")))
                         conn->http1_remaining = (uint32_t) -1;
                 } else
 
-                if (cno_buffer_eq(it->name, CNO_BUFFER_STRING("host"))) {
-                    it->name = CNO_BUFFER_STRING(":authority");
+                if (it->token == CNO_TOKEN_HOST) {
+                    it->name  = CNO_BUFFER_STRING(":authority");
+                    it->token = CNO_TOKEN_AUTHORITY;
                 }
             }
 
@@ -1049,6 +1426,18 @@ static int cno_connection_proceed(struct cno_connection_t *conn)
 
             cno_buffer_dyn_shift(&conn->buffer, (size_t) ok);
 
+            if (conn->on_header) {
+                // stream the regular headers, leave the pseudo ones for `on_message_start`.
+                size_t kept = 0;
+                for (size_t i = 0; i < msg.headers_len; i++) {
+                    if (headers[i].token && headers[i].token < CNO_TOKEN_FIRST_REGULAR)
+                        headers[kept++] = headers[i];
+                    else if (CNO_FIRE(conn, on_header, stream->id, &headers[i]))
+                        return CNO_ERROR_UP();
+                }
+                msg.headers_len = kept;
+            }
+
             if (CNO_FIRE(conn, on_message_start, stream->id, &msg))
                 return CNO_ERROR_UP();
 
@@ -1187,6 +1576,25 @@ static int cno_connection_proceed(struct cno_connection_t *conn)
             break;
         }
     }
+    return CNO_OK;
+}
+
+
+/* nothing has been allocated yet, so this is the last chance to switch allocators. */
+static void cno_connection_attach(struct cno_connection_t *conn)
+{
+    conn->buffer.allocator    = conn->allocator;
+    conn->continued.allocator = conn->allocator;
+    conn->output.allocator    = conn->allocator;
+    conn->headers.allocator   = conn->allocator;
+    if (!conn->encoder.allocator)
+        conn->encoder.allocator = conn->allocator;
+    if (!conn->decoder.allocator)
+        conn->decoder.allocator = conn->allocator;
+    if (conn->hpack_budget) {
+        cno_hpack_set_budget(&conn->encoder, conn->hpack_budget);
+        cno_hpack_set_budget(&conn->decoder, conn->hpack_budget);
+    }
 }
 
 
@@ -1195,20 +1603,287 @@ int cno_connection_made(struct cno_connection_t *conn, enum CNO_HTTP_VERSION ver
     if (conn->state != CNO_CONNECTION_UNDEFINED)
         return CNO_ERROR(ASSERTION, "called connection_made twice");
 
+    cno_connection_attach(conn);
     conn->state = version == CNO_HTTP2 ? CNO_CONNECTION_INIT : CNO_CONNECTION_HTTP1_READY;
     return cno_connection_proceed(conn);
 }
 
 
-int cno_connection_data_received(struct cno_connection_t *conn, const char *data, size_t length)
+int cno_connection_serialize(const struct cno_connection_t *conn, struct cno_buffer_dyn_t *out)
 {
     if (conn->state == CNO_CONNECTION_UNDEFINED)
         return CNO_ERROR(DISCONNECT, "connection closed");
 
-    if (cno_buffer_dyn_concat(&conn->buffer, (struct cno_buffer_t) { data, length }))
+    const uint64_t head[] = {
+        conn->client, conn->state, conn->flags, conn->continued_flags,
+        conn->continued_stream, conn->continued_promise, conn->http1_remaining,
+        (uint32_t) conn->window_recv, (uint32_t) conn->window_send,
+        conn->last_stream[0], conn->last_stream[1], conn->goaway_sent,
+        conn->header_table_size, conn->max_headers, conn->goaway_recv,
+    };
+
+    if (cno_buffer_dyn_concat(out, CNO_SERIALIZED_MAGIC))
         return CNO_ERROR_UP();
+    for (size_t i = 0; i < sizeof(head) / sizeof(head[0]); i++)
+        if (cno_buffer_dyn_put_uint(out, head[i]))
+            return CNO_ERROR_UP();
+    for (size_t i = 0; i < 2 * 6; i++)
+        if (cno_buffer_dyn_put_uint(out, conn->settings[i / 6].array[i % 6]))
+            return CNO_ERROR_UP();
 
-    return cno_connection_proceed(conn);
+    if (cno_buffer_dyn_put_uint(out, conn->stream_count[0] + conn->stream_count[1]))
+        return CNO_ERROR_UP();
+    for (size_t i = 0; i < CNO_STREAM_BUCKETS; i++)
+        for (const struct cno_stream_t *s = conn->streams[i]; s; s = s->next)
+            if (cno_buffer_dyn_put_uint(out, s->id)
+             || cno_buffer_dyn_put_uint(out, (uint32_t) s->window_recv)
+             || cno_buffer_dyn_put_uint(out, (uint32_t) s->window_send)
+             || cno_buffer_dyn_put_uint(out, s->accept))
+                return CNO_ERROR_UP();
+
+    // oldest first, so that a different CNO_STREAM_RESET_HISTORY keeps the newest ones.
+#if CNO_STREAM_RESET_HISTORY
+    if (cno_buffer_dyn_put_uint(out, CNO_STREAM_RESET_HISTORY))
+        return CNO_ERROR_UP();
+    for (size_t i = 0; i < CNO_STREAM_RESET_HISTORY; i++)
+        if (cno_buffer_dyn_put_uint(out, conn->recently_reset[(conn->recently_reset_next + i) % CNO_STREAM_RESET_HISTORY]))
+            return CNO_ERROR_UP();
+#else
+    if (cno_buffer_dyn_put_uint(out, 0))
+        return CNO_ERROR_UP();
+#endif
+
+    if (cno_hpack_save(&conn->encoder, out)
+     || cno_hpack_save(&conn->decoder, out)
+     || cno_buffer_dyn_put_str(out, conn->buffer.as_static)
+     || cno_buffer_dyn_put_str(out, conn->continued.as_static))
+        return CNO_ERROR_UP();
+
+    return CNO_OK;
+}
+
+
+static int cno_connection_restore(struct cno_connection_t *conn, struct cno_buffer_t *in, uint8_t *state)
+{
+    uint64_t head[15], settings[2 * 6], n;
+    for (size_t i = 0; i < sizeof(head) / sizeof(head[0]); i++)
+        if (cno_buffer_get_uint(in, &head[i]))
+            return CNO_ERROR_UP();
+        else if (head[i] > (i < 4 ? UINT8_MAX : UINT32_MAX))
+            return CNO_ERROR(ASSERTION, "invalid connection state");
+    for (size_t i = 0; i < 2 * 6; i++)
+        if (cno_buffer_get_uint(in, &settings[i]))
+            return CNO_ERROR_UP();
+        else if (settings[i] > UINT32_MAX)
+            return CNO_ERROR(ASSERTION, "invalid connection settings");
+
+    if (head[1] >= CNO_CONNECTION_UNDEFINED)
+        return CNO_ERROR(ASSERTION, "invalid connection state");
+
+    *state                  = head[1];
+    conn->client            = head[0] != 0;
+    conn->flags             = head[2];
+    conn->continued_flags   = head[3];
+    conn->continued_stream  = head[4];
+    conn->continued_promise = head[5];
+    conn->http1_remaining   = head[6];
+    conn->window_recv       = (int32_t) (uint32_t) head[7];
+    conn->window_send       = (int32_t) (uint32_t) head[8];
+    conn->last_stream[0]    = head[9];
+    conn->last_stream[1]    = head[10];
+    conn->goaway_sent       = head[11];
+    conn->header_table_size = head[12];
+    conn->max_headers       = head[13];
+    conn->goaway_recv       = head[14];
+    for (size_t i = 0; i < 2 * 6; i++)
+        conn->settings[i / 6].array[i % 6] = settings[i];
+
+    if (cno_buffer_get_uint(in, &n))
+        return CNO_ERROR_UP();
+    while (n--) {
+        uint64_t s[4];
+        for (size_t i = 0; i < 4; i++)
+            if (cno_buffer_get_uint(in, &s[i]))
+                return CNO_ERROR_UP();
+        if (!s[0] || s[0] > INT32_MAX || s[1] > UINT32_MAX || s[2] > UINT32_MAX || s[3] > UINT8_MAX
+         || cno_stream_find(conn, s[0]))
+            return CNO_ERROR(ASSERTION, "invalid stream");
+
+        // not `cno_stream_new`: these streams have already been started, so no events.
+        struct cno_stream_t *stream = cno_malloc(conn->allocator, sizeof(struct cno_stream_t));
+        if (!stream)
+            return CNO_ERROR(NO_MEMORY, "%zu bytes", sizeof(struct cno_stream_t));
+        *stream = (struct cno_stream_t) {
+            .id          = s[0],
+            .next        = conn->streams[s[0] % CNO_STREAM_BUCKETS],
+            .window_recv = (int32_t) (uint32_t) s[1],
+            .window_send = (int32_t) (uint32_t) s[2],
+            .accept      = s[3],
+        };
+        conn->streams[s[0] % CNO_STREAM_BUCKETS] = stream;
+        conn->stream_count[cno_stream_is_local(conn, s[0])]++;
+    }
+
+    if (cno_buffer_get_uint(in, &n))
+        return CNO_ERROR_UP();
+    while (n--) {
+        uint64_t id;
+        if (cno_buffer_get_uint(in, &id))
+            return CNO_ERROR_UP();
+#if CNO_STREAM_RESET_HISTORY
+        conn->recently_reset[conn->recently_reset_next++] = id;
+        conn->recently_reset_next %= CNO_STREAM_RESET_HISTORY;
+#endif
+    }
+
+    struct cno_buffer_t buffer, continued;
+    if (cno_hpack_load(&conn->encoder, in)
+     || cno_hpack_load(&conn->decoder, in)
+     || cno_buffer_get_str(in, &buffer)
+     || cno_buffer_get_str(in, &continued)
+     || cno_buffer_dyn_concat(&conn->buffer, buffer)
+     || cno_buffer_dyn_concat(&conn->continued, continued))
+        return CNO_ERROR_UP();
+
+    if (in->size)
+        return CNO_ERROR(ASSERTION, "trailing data after connection state");
+    return CNO_OK;
+}
+
+
+int cno_connection_deserialize(struct cno_connection_t *conn, struct cno_buffer_t in)
+{
+    if (conn->state != CNO_CONNECTION_UNDEFINED)
+        return CNO_ERROR(ASSERTION, "connection already started");
+
+    if (!cno_buffer_startswith(in, CNO_SERIALIZED_MAGIC))
+        return CNO_ERROR(ASSERTION, "not a serialized connection, or a different format version");
+
+    in.data += CNO_SERIALIZED_MAGIC.size;
+    in.size -= CNO_SERIALIZED_MAGIC.size;
+    cno_connection_attach(conn);
+
+    // the state is set last so that on failure, the connection is still closed
+    // (and whatever was restored so far is freed by `cno_connection_reset`).
+    uint8_t state;
+    if (cno_connection_restore(conn, &in, &state))
+        return CNO_ERROR_UP();
+    conn->state = state;
+    return CNO_OK;
+}
+
+
+static int cno_connection_is_framed(const struct cno_connection_t *conn)
+{
+    return conn->state == CNO_CONNECTION_READY || conn->state == CNO_CONNECTION_READY_NO_SETTINGS;
+}
+
+
+/* If `consumed` is not NULL and parsing is paused midway, the rest of `data` is not buffered;
+   `*consumed` is set to how much of it has been. */
+static int cno_connection_consume(struct cno_connection_t *conn, const char *data, size_t length, size_t *consumed)
+{
+    // Once in HTTP 2 mode, frames are parsed straight from `data`. Only a frame split
+    // between two calls is copied, into a buffer that is reserved for the whole frame as
+    // soon as its header is known, so it is never moved or regrown while being filled.
+    // (HTTP/1 lowercases header names in place, so it has to own the memory.)
+    const size_t max_frame = 9 + (size_t) conn->settings[CNO_LOCAL].max_frame_size;
+    const size_t total = length;
+    int ret = CNO_OK;
+    while (!ret && length && cno_connection_is_framed(conn) && !(conn->flags & CNO_CONN_FLAG_PAUSED)) {
+        if (conn->buffer.size) {
+            size_t want = conn->buffer.size < 9 ? 9 : 9 + read3((const uint8_t *) conn->buffer.data);
+            if (want > max_frame || want <= conn->buffer.size)
+                break;  // let `cno_connection_proceed` complain
+            size_t take = want - conn->buffer.size < length ? want - conn->buffer.size : length;
+            if (cno_buffer_dyn_reserve(&conn->buffer, want)
+             || cno_buffer_dyn_concat(&conn->buffer, (struct cno_buffer_t) { data, take }))
+                return CNO_ERROR_UP();
+            data += take;
+            length -= take;
+            ret = cno_connection_proceed(conn);
+        } else {
+            struct cno_buffer_dyn_t owned = conn->buffer;
+            conn->buffer = (struct cno_buffer_dyn_t) { {{ (char *) data, length }}, 0, length, NULL };
+            ret = cno_connection_proceed(conn);
+            data += length - conn->buffer.size;
+            length = conn->buffer.size;
+            conn->buffer = owned;
+            if (!ret && !(conn->flags & CNO_CONN_FLAG_PAUSED) && length >= 9 && 9 + read3((const uint8_t *) data) <= max_frame && cno_connection_is_framed(conn))
+                if (cno_buffer_dyn_reserve(&conn->buffer, 9 + read3((const uint8_t *) data)))
+                    return CNO_ERROR_UP();
+            break;
+        }
+    }
+
+    if (consumed && (conn->flags & CNO_CONN_FLAG_PAUSED)) {
+        *consumed = total - length;
+        return ret;
+    }
+
+    // Whatever is left, even after an error, stays buffered until the next call.
+    if (length && cno_buffer_dyn_concat(&conn->buffer, (struct cno_buffer_t) { data, length }))
+        return CNO_ERROR_UP();
+
+    if (!ret)
+        ret = cno_connection_proceed(conn);
+
+    if (consumed) {
+        // HTTP/1.x is parsed from the buffer; if it paused, the unparsed end of `data`
+        // is still at the end of it, unmodified, so it can be given back.
+        size_t back = !(conn->flags & CNO_CONN_FLAG_PAUSED) ? 0 : length < conn->buffer.size ? length : conn->buffer.size;
+        conn->buffer.size -= back;
+        *consumed = total - back;
+    }
+    return ret;
+}
+
+
+static int cno_connection_received(struct cno_connection_t *conn, const char *data, size_t length, size_t *consumed)
+{
+    if (conn->state == CNO_CONNECTION_UNDEFINED)
+        return CNO_ERROR(DISCONNECT, "connection closed");
+
+    if (cno_connection_consume(conn, data, length, consumed) || cno_connection_govern(conn))
+        return CNO_ERROR_UP();
+
+    if (conn->goaway_recv != (uint32_t) -1 && !conn->stream_count[CNO_LOCAL] && !conn->stream_count[CNO_REMOTE])
+        return CNO_ERROR(DISCONNECT, "disconnected");
+
+    if (conn->flags & CNO_CONN_FLAG_SHRINK_WHEN_IDLE) {
+        // split frames are rare enough that it's cheaper to allocate a buffer for each one.
+        if (!conn->buffer.size)
+            cno_buffer_dyn_clear(&conn->buffer);
+        if (!conn->stream_count[CNO_LOCAL] && !conn->stream_count[CNO_REMOTE])
+            cno_connection_release(conn);
+    }
+    return CNO_OK;
+}
+
+
+int cno_connection_data_received(struct cno_connection_t *conn, const char *data, size_t length)
+{
+    return cno_connection_received(conn, data, length, NULL);
+}
+
+
+int cno_connection_data_received_partial(struct cno_connection_t *conn, const char *data, size_t length, size_t *consumed)
+{
+    *consumed = 0;
+    return cno_connection_received(conn, data, length, consumed);
+}
+
+
+void cno_connection_pause(struct cno_connection_t *conn)
+{
+    conn->flags |= CNO_CONN_FLAG_PAUSED;
+}
+
+
+int cno_connection_resume(struct cno_connection_t *conn)
+{
+    conn->flags &= ~CNO_CONN_FLAG_PAUSED;
+    return cno_connection_data_received(conn, NULL, 0);
 }
 
 
@@ -1276,6 +1951,27 @@ int cno_write_reset(struct cno_connection_t *conn, uint32_t stream, enum CNO_RST
 }
 
 
+/* take `conn->output` for the duration of a write. the payload is passed to `on_frame_send`
+   and `on_write`, which may write other messages that would otherwise reuse the buffer. */
+static struct cno_buffer_dyn_t cno_output_borrow(struct cno_connection_t *conn)
+{
+    struct cno_buffer_dyn_t b = conn->output;
+    conn->output = CNO_BUFFER_DYN_EMPTY;
+    conn->output.allocator = b.allocator;
+    return b;
+}
+
+
+static void cno_output_return(struct cno_connection_t *conn, struct cno_buffer_dyn_t *b)
+{
+    if (conn->output.data)
+        // a nested write has allocated a buffer of its own; keep that one.
+        cno_buffer_dyn_clear(b);
+    else
+        conn->output = *b;
+}
+
+
 int cno_write_push(struct cno_connection_t *conn, uint32_t stream, const struct cno_message_t *msg)
 {
     if (conn->state == CNO_CONNECTION_UNDEFINED)
@@ -1304,24 +2000,242 @@ int cno_write_push(struct cno_connection_t *conn, uint32_t stream, const struct
 
     childobj->accept = CNO_ACCEPT_WRITE_HEADERS;
 
-    struct cno_buffer_dyn_t payload = CNO_BUFFER_DYN_EMPTY;
+    if (cno_connection_govern(conn))
+        return CNO_ERROR_UP();
+
+    struct cno_buffer_dyn_t payload = cno_output_borrow(conn);
     struct cno_frame_t frame = { CNO_FRAME_PUSH_PROMISE, CNO_FLAG_END_HEADERS, stream, CNO_BUFFER_EMPTY };
     struct cno_header_t head[2] = {
-        { CNO_BUFFER_STRING(":method"), msg->method, 0 },
-        { CNO_BUFFER_STRING(":path"),   msg->path,   0 },
+        { CNO_BUFFER_STRING(":method"), msg->method, 0, CNO_TOKEN_METHOD },
+        { CNO_BUFFER_STRING(":path"),   msg->path,   0, CNO_TOKEN_PATH },
     };
 
-    if (cno_buffer_dyn_concat(&payload, (struct cno_buffer_t) { PACK(I32(child)) })
-    ||  cno_hpack_encode(&conn->encoder, &payload, head, 2)
-    ||  cno_hpack_encode(&conn->encoder, &payload, msg->headers, msg->headers_len))
-        return cno_buffer_dyn_clear(&payload), CNO_ERROR_UP();
+    payload.size = 0;
+    int failed = cno_buffer_dyn_concat(&payload, (struct cno_buffer_t) { PACK(I32(child)) })
+              || cno_hpack_encode(&conn->encoder, &payload, head, 2)
+              || cno_hpack_encode(&conn->encoder, &payload, msg->headers, msg->headers_len)
+              || (msg->tmpl && cno_buffer_dyn_concat(&payload, msg->tmpl->http2.as_static))
+              || (frame.payload = payload.as_static, cno_frame_write(conn, &frame));
+    cno_output_return(conn, &payload);
+    if (failed)
+        return CNO_ERROR_UP();
+    return CNO_FIRE(conn, on_message_start, child, msg) || CNO_FIRE(conn, on_message_end, child);
+}
 
-    frame.payload = payload.as_static;
-    if (cno_frame_write(conn, &frame))
-        return cno_buffer_dyn_clear(&payload), CNO_ERROR_UP();
 
-    cno_buffer_dyn_clear(&payload);
-    return CNO_FIRE(conn, on_message_start, child, msg) || CNO_FIRE(conn, on_message_end, child);
+/* precomputed HTTP/1.1 status lines; empty if the code has no standard reason phrase. */
+static struct cno_buffer_t cno_http1_status_line(int code)
+{
+    #define STATUS(c, reason) case c: return (struct cno_buffer_t) \
+        { "HTTP/1.1 " #c " " reason "\r\n", sizeof("HTTP/1.1 " #c " " reason "\r\n") - 1 };
+    switch (code) {
+        STATUS(100, "Continue")
+        STATUS(101, "Switching Protocols")
+        STATUS(102, "Processing")
+        STATUS(103, "Early Hints")
+        STATUS(200, "OK")
+        STATUS(201, "Created")
+        STATUS(202, "Accepted")
+        STATUS(203, "Non-Authoritative Information")
+        STATUS(204, "No Content")
+        STATUS(205, "Reset Content")
+        STATUS(206, "Partial Content")
+        STATUS(207, "Multi-Status")
+        STATUS(208, "Already Reported")
+        STATUS(226, "IM Used")
+        STATUS(300, "Multiple Choices")
+        STATUS(301, "Moved Permanently")
+        STATUS(302, "Found")
+        STATUS(303, "See Other")
+        STATUS(304, "Not Modified")
+        STATUS(305, "Use Proxy")
+        STATUS(307, "Temporary Redirect")
+        STATUS(308, "Permanent Redirect")
+        STATUS(400, "Bad Request")
+        STATUS(401, "Unauthorized")
+        STATUS(402, "Payment Required")
+        STATUS(403, "Forbidden")
+        STATUS(404, "Not Found")
+        STATUS(405, "Method Not Allowed")
+        STATUS(406, "Not Acceptable")
+        STATUS(407, "Proxy Authentication Required")
+        STATUS(408, "Request Timeout")
+        STATUS(409, "Conflict")
+        STATUS(410, "Gone")
+        STATUS(411, "Length Required")
+        STATUS(412, "Precondition Failed")
+        STATUS(413, "Payload Too Large")
+        STATUS(414, "URI Too Long")
+        STATUS(415, "Unsupported Media Type")
+        STATUS(416, "Range Not Satisfiable")
+        STATUS(417, "Expectation Failed")
+        STATUS(421, "Misdirected Request")
+        STATUS(422, "Unprocessable Entity")
+        STATUS(423, "Locked")
+        STATUS(424, "Failed Dependency")
+        STATUS(425, "Too Early")
+        STATUS(426, "Upgrade Required")
+        STATUS(428, "Precondition Required")
+        STATUS(429, "Too Many Requests")
+        STATUS(431, "Request Header Fields Too Large")
+        STATUS(451, "Unavailable For Legal Reasons")
+        STATUS(500, "Internal Server Error")
+        STATUS(501, "Not Implemented")
+        STATUS(502, "Bad Gateway")
+        STATUS(503, "Service Unavailable")
+        STATUS(504, "Gateway Timeout")
+        STATUS(505, "HTTP Version Not Supported")
+        STATUS(506, "Variant Also Negotiates")
+        STATUS(507, "Insufficient Storage")
+        STATUS(508, "Loop Detected")
+        STATUS(511, "Network Authentication Required")
+    }
+    #undef STATUS
+    return CNO_BUFFER_EMPTY;
+}
+
+
+/* append `a`, `b`, and `c` to a buffer with a single reallocation. */
+static int cno_buffer_dyn_concat3(struct cno_buffer_dyn_t *buf, struct cno_buffer_t a,
+                                  struct cno_buffer_t b, struct cno_buffer_t c)
+{
+    if (cno_buffer_dyn_reserve(buf, buf->size + a.size + b.size + c.size))
+        return CNO_ERROR_UP();
+
+    char *ptr = buf->data + buf->size;
+    if (a.size) memcpy(ptr, a.data, a.size), ptr += a.size;
+    if (b.size) memcpy(ptr, b.data, b.size), ptr += b.size;
+    if (c.size) memcpy(ptr, c.data, c.size), ptr += c.size;
+    buf->size = ptr - buf->data;
+    return CNO_OK;
+}
+
+
+static int cno_http1_encode_header(struct cno_buffer_dyn_t *buf, struct cno_buffer_t name, struct cno_buffer_t value)
+{
+    // a stray crlf would allow whoever controls the value to inject headers or even messages.
+    if (cno_header_value_is_invalid(name) || cno_header_value_is_invalid(value))
+        return CNO_ERROR(ASSERTION, "header contains CR, LF, or NUL");
+
+    return cno_buffer_dyn_concat3(buf, name, (struct cno_buffer_t) { ": ", 2 }, value)
+        || cno_buffer_dyn_concat(buf, (struct cno_buffer_t) { "\r\n", 2 });
+}
+
+
+/* append headers to an HTTP/1.x message head, skipping pseudo-headers. `flags` is
+   updated with a combination of CNO_TEMPLATE_* describing the headers written. */
+static int cno_http1_encode_headers(struct cno_buffer_dyn_t *buf, const struct cno_header_t *it, size_t n, uint8_t *flags)
+{
+    for (const struct cno_header_t *end = it + n; it != end; ++it) {
+        struct cno_buffer_t name = it->name;
+        struct cno_buffer_t value = it->value;
+
+        if (cno_buffer_eq(name, CNO_BUFFER_STRING(":authority")))
+            name = CNO_BUFFER_STRING("host");
+
+        else if (cno_buffer_startswith(name, CNO_BUFFER_STRING(":")))
+            continue;
+
+        else if (cno_buffer_eq(name, CNO_BUFFER_STRING("connection")))
+            *flags |= CNO_TEMPLATE_HAS_CONNECTION;
+
+        else if (cno_buffer_eq(name, CNO_BUFFER_STRING("content-length"))
+              || cno_buffer_eq(name, CNO_BUFFER_STRING("upgrade")))
+            *flags |= CNO_TEMPLATE_NOT_CHUNKED;
+
+        else if (cno_buffer_eq(name, CNO_BUFFER_STRING("transfer-encoding"))) {
+            // assuming the request is valid, chunked can only be the last transfer-encoding
+            if (cno_buffer_eq(value, CNO_BUFFER_STRING("chunked")))
+                continue;
+            else if (cno_buffer_endswith(value, CNO_BUFFER_STRING(", chunked")))
+                value.size -= 9;
+            else if (cno_buffer_endswith(value, CNO_BUFFER_STRING(",chunked")))
+                value.size -= 8;
+        }
+
+        if (cno_http1_encode_header(buf, name, value))
+            return CNO_ERROR_UP();
+    }
+
+    return CNO_OK;
+}
+
+
+/* serialize the request/status line and all headers of an HTTP/1.x message into
+   `conn->output`, so that the whole head can be passed to `on_write` at once.
+   the buffer is reused between messages, so in the steady state this does not allocate.
+   also toggles chunked transfer-encoding for the payload that follows. */
+static int cno_http1_encode_head(struct cno_connection_t *conn, const struct cno_message_t *msg, int no_payload)
+{
+    struct cno_buffer_dyn_t *buf = &conn->output;
+    buf->size = 0;
+
+    if (conn->client) {
+        if (cno_header_value_is_invalid(msg->method) || cno_header_value_is_invalid(msg->path))
+            return CNO_ERROR(ASSERTION, "method/path contains CR, LF, or NUL");
+
+        if (cno_buffer_dyn_concat3(buf, msg->method, (struct cno_buffer_t) { " ", 1 }, msg->path)
+         || cno_buffer_dyn_concat(buf, (struct cno_buffer_t) { " HTTP/1.1\r\n", 11 }))
+            return CNO_ERROR_UP();
+    } else {
+        struct cno_buffer_t line = cno_http1_status_line(msg->code);
+        char unknown[32];
+
+        if (!line.size)
+            line = (struct cno_buffer_t) { unknown, snprintf(unknown, sizeof(unknown), "HTTP/1.1 %d Unknown\r\n", msg->code) };
+
+        if (cno_buffer_dyn_concat(buf, line))
+            return CNO_ERROR_UP();
+    }
+
+    uint8_t flags = msg->tmpl ? msg->tmpl->flags : 0;
+
+    if (cno_http1_encode_headers(buf, msg->headers, msg->headers_len, &flags))
+        return CNO_ERROR_UP();
+
+    if (msg->tmpl && cno_buffer_dyn_concat(buf, msg->tmpl->http1.as_static))
+        return CNO_ERROR_UP();
+
+    if (no_payload || flags & CNO_TEMPLATE_NOT_CHUNKED)
+        conn->flags &= ~CNO_CONN_FLAG_WRITING_CHUNKED;
+    else
+        conn->flags |= CNO_CONN_FLAG_WRITING_CHUNKED;
+
+    if (conn->flags & CNO_CONN_FLAG_WRITING_CHUNKED)
+        if (cno_buffer_dyn_concat(buf, (struct cno_buffer_t) { "transfer-encoding: chunked\r\n", 28 }))
+            return CNO_ERROR_UP();
+
+    if (!(flags & CNO_TEMPLATE_HAS_CONNECTION))
+        if (cno_buffer_dyn_concat(buf, (struct cno_buffer_t) { "connection: keep-alive\r\n", 24 }))
+            return CNO_ERROR_UP();
+
+    return cno_buffer_dyn_concat(buf, (struct cno_buffer_t) { "\r\n", 2 });
+}
+
+
+int cno_header_template_init(struct cno_header_template_t *t, const struct cno_header_t *headers, size_t n)
+{
+    *t = (struct cno_header_template_t) { CNO_BUFFER_DYN_EMPTY, CNO_BUFFER_DYN_EMPTY, 0 };
+
+    for (size_t i = 0; i < n; i++)
+        if (cno_buffer_startswith(headers[i].name, CNO_BUFFER_STRING(":")))
+            // these must come before everything else, and templates are always appended last.
+            return CNO_ERROR(ASSERTION, "header templates cannot contain pseudo-headers");
+
+    if (cno_http1_encode_headers(&t->http1, headers, n, &t->flags)
+     || cno_hpack_encode_static(&t->http2, headers, n)) {
+        cno_header_template_clear(t);
+        return CNO_ERROR_UP();
+    }
+
+    return CNO_OK;
+}
+
+
+void cno_header_template_clear(struct cno_header_template_t *t)
+{
+    cno_buffer_dyn_clear(&t->http1);
+    cno_buffer_dyn_clear(&t->http2);
 }
 
 
@@ -1361,77 +2275,13 @@ int cno_write_message(struct cno_connection_t *conn, uint32_t stream, const stru
     }
 
     if (!cno_connection_is_http2(conn)) {
-        char buffer[CNO_MAX_HTTP1_HEADER_SIZE + 3];
-        int size;
-
-        if (conn->client)
-            size = snprintf(buffer, sizeof(buffer), "%.*s %.*s HTTP/1.1\r\n",
-                (int) msg->method.size, msg->method.data,
-                (int) msg->path.size,   msg->path.data);
-        else
-            size = snprintf(buffer, sizeof(buffer), "HTTP/1.1 %d Something\r\n", msg->code);
-
-        if (size > CNO_MAX_HTTP1_HEADER_SIZE)
-            return CNO_ERROR(ASSERTION, "method/path too big");
-
-        if (CNO_FIRE(conn, on_write, buffer, size))
+        if (cno_http1_encode_head(conn, msg, is_informational || final))
             return CNO_ERROR_UP();
 
-        struct cno_header_t *it  = msg->headers;
-        struct cno_header_t *end = msg->headers_len + it;
-        int had_connection_header = 0;
-
-        if (is_informational || final)
-            conn->flags &= ~CNO_CONN_FLAG_WRITING_CHUNKED;
-        else
-            conn->flags |= CNO_CONN_FLAG_WRITING_CHUNKED;
-
-        for (; it != end; ++it) {
-            struct cno_buffer_t name = it->name;
-            struct cno_buffer_t value = it->value;
-
-            if (cno_buffer_eq(name, CNO_BUFFER_STRING(":authority")))
-                name = CNO_BUFFER_STRING("host");
-
-            else if (cno_buffer_startswith(name, CNO_BUFFER_STRING(":")))
-                continue;
-
-            else if (cno_buffer_eq(name, CNO_BUFFER_STRING("connection")))
-                had_connection_header = 1;
-
-            else if (cno_buffer_eq(name, CNO_BUFFER_STRING("content-length"))
-                  || cno_buffer_eq(name, CNO_BUFFER_STRING("upgrade")))
-                conn->flags &= ~CNO_CONN_FLAG_WRITING_CHUNKED;
-
-            else if (cno_buffer_eq(name, CNO_BUFFER_STRING("transfer-encoding"))) {
-                // assuming the request is valid, chunked can only be the last transfer-encoding
-                if (cno_buffer_eq(value, CNO_BUFFER_STRING("chunked")))
-                    continue;
-                else if (cno_buffer_endswith(value, CNO_BUFFER_STRING(", chunked")))
-                    value.size -= 9;
-                else if (cno_buffer_endswith(value, CNO_BUFFER_STRING(",chunked")))
-                    value.size -= 8;
-            }
-
-            size = snprintf(buffer, sizeof(buffer), "%.*s: %.*s\r\n",
-                (int) name.size, name.data, (int) value.size, value.data);
-
-            if ((size_t)size > sizeof(buffer))
-                return CNO_ERROR(ASSERTION, "header too big\r\n");
-
-            if (size && CNO_FIRE(conn, on_write, buffer, size))
-                return CNO_ERROR_UP();
-        }
-
-        if (conn->flags & CNO_CONN_FLAG_WRITING_CHUNKED)
-            if (CNO_FIRE(conn, on_write, "transfer-encoding: chunked\r\n", 28))
-                return CNO_ERROR_UP();
-
-        if (!had_connection_header)
-            if (CNO_FIRE(conn, on_write, "connection: keep-alive\r\n", 24))
-                return CNO_ERROR_UP();
-
-        if (CNO_FIRE(conn, on_write, "\r\n", 2))
+        struct cno_buffer_dyn_t head = cno_output_borrow(conn);
+        int failed = CNO_FIRE(conn, on_write, head.data, head.size);
+        cno_output_return(conn, &head);
+        if (failed)
             return CNO_ERROR_UP();
 
         if (msg->code == 101 && conn->state == CNO_CONNECTION_UNKNOWN_PROTOCOL_UPGRADE) {
@@ -1439,39 +2289,41 @@ int cno_write_message(struct cno_connection_t *conn, uint32_t stream, const stru
             is_informational = 0;
         }
     } else {
-        struct cno_buffer_dyn_t payload = CNO_BUFFER_DYN_EMPTY;
+        if (cno_connection_govern(conn))
+            return CNO_ERROR_UP();
+
+        struct cno_buffer_dyn_t payload = cno_output_borrow(conn);
         struct cno_frame_t frame = { CNO_FRAME_HEADERS, CNO_FLAG_END_HEADERS, stream, CNO_BUFFER_EMPTY };
+        int failed;
+
+        payload.size = 0;
 
         if (final)
             frame.flags |= CNO_FLAG_END_STREAM;
 
         if (conn->client) {
             struct cno_header_t head[] = {
-                { CNO_BUFFER_STRING(":method"), msg->method, 0 },
-                { CNO_BUFFER_STRING(":path"),   msg->path,   0 },
+                { CNO_BUFFER_STRING(":method"), msg->method, 0, CNO_TOKEN_METHOD },
+                { CNO_BUFFER_STRING(":path"),   msg->path,   0, CNO_TOKEN_PATH },
             };
 
-            if (cno_hpack_encode(&conn->encoder, &payload, head, 2))
-                return cno_buffer_dyn_clear(&payload), CNO_ERROR_UP();
+            failed = cno_hpack_encode(&conn->encoder, &payload, head, 2);
         } else {
             char code[8];
             struct cno_header_t head[] = {
-                { CNO_BUFFER_STRING(":status"), {code, snprintf(code, sizeof(code), "%d", msg->code)}, 0 }
+                { CNO_BUFFER_STRING(":status"), {code, snprintf(code, sizeof(code), "%d", msg->code)}, 0, CNO_TOKEN_STATUS }
             };
 
-            if (cno_hpack_encode(&conn->encoder, &payload, head, 1))
-                return cno_buffer_dyn_clear(&payload), CNO_ERROR_UP();
+            failed = cno_hpack_encode(&conn->encoder, &payload, head, 1);
         }
 
-        if (cno_hpack_encode(&conn->encoder, &payload, msg->headers, msg->headers_len))
-            return cno_buffer_dyn_clear(&payload), CNO_ERROR_UP();
-
-        frame.payload = payload.as_static;
-
-        if (cno_frame_write(conn, &frame))
-            return cno_buffer_dyn_clear(&payload), CNO_ERROR_UP();
-
-        cno_buffer_dyn_clear(&payload);
+        failed = failed
+              || cno_hpack_encode(&conn->encoder, &payload, msg->headers, msg->headers_len)
+              || (msg->tmpl && cno_buffer_dyn_concat(&payload, msg->tmpl->http2.as_static))
+              || (frame.payload = payload.as_static, cno_frame_write(conn, &frame));
+        cno_output_return(conn, &payload);
+        if (failed)
+            return CNO_ERROR_UP();
     }
 
     if (final)
@@ -57,6 +57,12 @@ enum CNO_CONNECTION_FLAGS
     CNO_CONN_FLAG_DISALLOW_H2_UPGRADE = 0x04,
     // Disable special handling of the HTTP2 preface in HTTP/1.x mode.
     CNO_CONN_FLAG_DISALLOW_H2_PRIOR_KNOWLEDGE = 0x08,
+    // After processing input, free the input buffer if it is empty; if there are no open
+    // streams, also free other empty buffers and pooled streams (see `cno_connection_shrink`).
+    // Trades a few mallocs per request for not keeping high-water marks on idle connections.
+    CNO_CONN_FLAG_SHRINK_WHEN_IDLE = 0x10,
+    // Set by `cno_connection_pause`: input is not processed until `cno_connection_resume`.
+    CNO_CONN_FLAG_PAUSED = 0x20,
 };
 
 
@@ -142,6 +148,24 @@ struct cno_frame_t
 };
 
 
+enum CNO_HEADER_TEMPLATE_FLAGS
+{
+    CNO_TEMPLATE_HAS_CONNECTION = 0x01,  // HTTP/1.x: don't add "connection: keep-alive"
+    CNO_TEMPLATE_NOT_CHUNKED    = 0x02,  // HTTP/1.x: has content-length or upgrade
+};
+
+
+/* A set of headers encoded once in both HTTP/1.x and HTTP 2 formats. The HPACK
+   representation only refers to the static table, so it is valid on any connection
+   and can be sent any number of times without touching the encoder's state. */
+struct cno_header_template_t
+{
+    struct cno_buffer_dyn_t http1;
+    struct cno_buffer_dyn_t http2;
+    uint8_t /* enum CNO_HEADER_TEMPLATE_FLAGS */ flags;
+};
+
+
 struct cno_message_t
 {
     int code;
@@ -149,6 +173,8 @@ struct cno_message_t
     struct cno_buffer_t path;
     struct cno_header_t *headers;
     size_t headers_len;
+    // optional; when writing, these are sent after `headers`. always NULL in events.
+    const struct cno_header_template_t *tmpl;
 };
 
 
@@ -178,6 +204,26 @@ struct cno_settings_t
 };
 
 
+/* A token bucket: allows `burst` events at once, then `rate` per second on average. */
+struct cno_rate_limit_t
+{
+    uint32_t rate;  // 0 = unlimited
+    uint32_t burst;
+    uint32_t tokens;
+    uint64_t time;  // in milliseconds, when `tokens` was last refilled
+};
+
+
+/* See `cno_connection_adjust_streams`. */
+struct cno_stream_limit_t
+{
+    uint32_t min;
+    uint32_t max;
+    uint32_t step;  // added to the limit while the application is not overloaded
+    double backoff;  // the most the limit is multiplied by at once while it is; 0 < backoff < 1
+};
+
+
 struct cno_connection_t
 {
     uint8_t /* enum CNO_PEER_KIND        */ client;
@@ -191,13 +237,42 @@ struct cno_connection_t
      int32_t window_send;
     uint32_t last_stream  [2];  // dereferencable with CNO_REMOTE/CNO_LOCAL
     uint32_t goaway_sent;
+    /* The last local stream that the peer will process; `-1` until it sends a GOAWAY.
+     * Streams above it are closed, no more can be opened, and the rest may complete;
+     * once they have, `cno_connection_data_received` fails with DISCONNECT. */
+    uint32_t goaway_recv;
     uint32_t stream_count [2];
     struct cno_settings_t settings[2];
     struct cno_buffer_dyn_t buffer;
     struct cno_buffer_dyn_t continued;  // concat CONTINUATIONs with this
+    struct cno_buffer_dyn_t output;  // reused to serialize message heads (HTTP/1.x) and header blocks (HTTP 2)
     struct cno_hpack_t decoder;
     struct cno_hpack_t encoder;
     struct cno_stream_t *streams[CNO_STREAM_BUCKETS];
+    struct cno_stream_t *stream_pool;  // closed streams kept for reuse, linked through `next`
+    uint32_t stream_pool_size;
+    /* All memory used by the connection (buffers, streams, HPACK tables unless those
+     * have their own allocator) comes from here; NULL means libc. Set it between
+     * `cno_connection_init` and `cno_connection_made`, and keep it alive until
+     * `cno_connection_reset` returns. */
+    const struct cno_allocator_t *allocator;
+    /* Optional, shared between connections on the same thread. While the HPACK tables of
+     * all of them take more than `hpack_budget->limit`, each connection shrinks its own
+     * to a fair share the next time it receives data or writes a message head; once there is room,
+     * they grow back to the configured sizes. Set it before `cno_connection_made`. */
+    struct cno_hpack_budget_t *hpack_budget;
+    uint32_t header_table_size;  // as configured; the advertised value may be lower due to `hpack_budget`
+    /* How many headers a single message may have; defaults to CNO_MAX_HEADERS. Messages with
+     * more are rejected (HTTP 2: the stream is reset; HTTP/1.x: the connection is dropped).
+     * Headers that do not fit in the stack arrays are collected in `headers` instead. */
+    uint32_t max_headers;
+    struct cno_buffer_dyn_t headers;
+    /* Flood protection: if the peer sends frames that are cheap for it, but not for us,
+     * faster than this, the connection is closed with ENHANCE_YOUR_CALM. Set `rate` and
+     * `burst` before `cno_connection_made` to override the defaults from config.h. */
+    struct cno_rate_limit_t limit_resets;  // RST_STREAM on open streams, i.e. "rapid reset"
+    struct cno_rate_limit_t limit_control;  // PING, SETTINGS, PRIORITY
+    struct cno_rate_limit_t limit_empty;  // DATA with neither payload nor END_STREAM
 #if CNO_STREAM_RESET_HISTORY
     uint32_t recently_reset[CNO_STREAM_RESET_HISTORY];
     uint8_t  recently_reset_next;
@@ -217,6 +292,9 @@ struct cno_connection_t
      *   on_stream_end
      *     -- called when a stream is terminated. if the response was not
      *        sent/received on that stream yet, the request was aborted.
+     *   on_stream_reset
+     *     -- optional. called before on_stream_end if the stream was terminated by
+     *        an RST_STREAM from the other side, with the error code from that frame.
      *   on_flow_increase
      *     -- called when the other side is ready to accept some more payload.
      *        there is a global limit and one for each stream; when the global one
@@ -225,6 +303,12 @@ struct cno_connection_t
      *     -- called when a real request/response is received on a stream
      *        (depending on whether this is a server connection or not).
      *        each stream carries exactly one request-response pair.
+     *   on_header
+     *     -- optional. if set, regular (non-pseudo) headers are passed to this one at a time
+     *        as they are decoded, and on_message_start/on_message_trail/on_message_push
+     *        only get the pseudo-headers. the header is only valid during the call.
+     *        if the message turns out to be malformed afterwards, the stream is reset
+     *        and on_message_start is never called.
      *   on_message_trail
      *     -- called before on_message_end if the message contains trailers.
      *   on_message_data
@@ -249,8 +333,10 @@ struct cno_connection_t
     int (*on_write         )(void *, const char * /* data */, size_t /* length */);
     int (*on_stream_start  )(void *, uint32_t /* stream id */);
     int (*on_stream_end    )(void *, uint32_t);
+    int (*on_stream_reset  )(void *, uint32_t, uint32_t /* enum CNO_RST_STREAM_CODE */);
     int (*on_flow_increase )(void *, uint32_t);
     int (*on_message_start )(void *, uint32_t, const struct cno_message_t * /* msg */);
+    int (*on_header        )(void *, uint32_t, const struct cno_header_t *);
     int (*on_message_trail )(void *, uint32_t, const struct cno_message_t * /* msg */);
     int (*on_message_push  )(void *, uint32_t, const struct cno_message_t *, uint32_t /* parent stream */);
     int (*on_message_data  )(void *, uint32_t, const char * /* data */, size_t /* length */);
@@ -288,6 +374,16 @@ int  cno_connection_data_received (struct cno_connection_t *, const char *, size
 int  cno_connection_lost          (struct cno_connection_t *);
 void cno_connection_reset         (struct cno_connection_t *);
 int  cno_connection_stop          (struct cno_connection_t *);
+/* Backpressure: if the application can't take more requests/data right now, it can call
+ * `cno_connection_pause` (e.g. from a callback) to stop parsing after the current frame
+ * (HTTP 2) or event (HTTP/1.x). `cno_connection_data_received` then buffers the rest of its
+ * input, while `cno_connection_data_received_partial` leaves it to the caller -- it stores
+ * how many bytes it has consumed in the last argument, so the transport can stop reading
+ * and keep the rest in the socket. `cno_connection_resume` processes what has been buffered
+ * so far, firing events; it must not be called from inside a callback. */
+void cno_connection_pause         (struct cno_connection_t *);
+int  cno_connection_resume        (struct cno_connection_t *);
+int  cno_connection_data_received_partial (struct cno_connection_t *, const char *, size_t, size_t *);
 /* Returns whether the next message will be sent in HTTP 2 mode.
    `cno_write_push` does nothing if this returns false. On the other hand,
    you can't switch protocols (e.g. to websockets) if this returns true. */
@@ -296,6 +392,41 @@ int  cno_connection_is_http2      (struct cno_connection_t *);
    The current configuration can be read through `conn->settings[CNO_LOCAL]`.
    DO NOT modify `conn->settings` directly -- it is used to compute the delta. */
 int  cno_connection_set_config    (struct cno_connection_t *, const struct cno_settings_t *);
+/* Admission control: lower SETTINGS_MAX_CONCURRENT_STREAMS while the application is overloaded,
+ * raise it back while it is not. `load` is any measure of how busy the application is, scaled
+ * so that 1 is its capacity -- e.g. queue depth / target depth, or handler latency / target
+ * latency. Above 1, the limit is multiplied by `1 / load`, but by no less than `backoff`;
+ * otherwise, it grows by `step`. It always stays within [min, max]. Every change is a SETTINGS
+ * frame, so call this periodically (e.g. every 100 ms) rather than for every request. Streams
+ * that the peer opens above the limit before it receives the new one are refused with
+ * REFUSED_STREAM without allocating anything or calling any callbacks. */
+int  cno_connection_adjust_streams(struct cno_connection_t *, const struct cno_stream_limit_t *, double load);
+/* Free memory that an idle connection does not need right now: empty buffers, pooled
+   streams, and the HPACK encoder's dynamic table (refilled as headers are sent again).
+   If `header_table_size` is below the current SETTINGS_HEADER_TABLE_SIZE, also send it
+   to the peer so that the decoder's table shrinks once the peer acknowledges it; pass
+   `-1` to keep the setting. Must not be called from inside a callback. */
+int  cno_connection_shrink        (struct cno_connection_t *, uint32_t header_table_size);
+
+/* Moving a connection to another thread or process:
+ *
+ *  cno_connection_serialize(old, &blob)  -- not from inside a callback
+ *  cno_connection_reset(old)  -- without cno_connection_lost: the streams are still open
+ *  (pass the blob and the socket to the new owner)
+ *  cno_connection_init(new, same kind as before)
+ *  new.allocator, new.hpack_budget, new.on_* = ...
+ *  cno_connection_deserialize(new, blob)  -- instead of cno_connection_made
+ *  cno_connection_data_received(new, NULL, 0)  -- if the old one returned WOULD_BLOCK
+ *
+ * The blob contains the protocol state: settings, flow control windows, open streams,
+ * both HPACK tables, unprocessed input, and recently reset streams. Application data
+ * attached to streams is not included, nor is the output of the old connection, which
+ * must be written out before the socket changes hands. Everything is restored as it was,
+ * connection flags included, without firing any events. Both sides must use the same
+ * version of cno; a blob in a different format is rejected with ASSERTION. If this fails,
+ * the connection is left closed and should be reset. */
+int  cno_connection_serialize     (const struct cno_connection_t *, struct cno_buffer_dyn_t *);
+int  cno_connection_deserialize   (struct cno_connection_t *, struct cno_buffer_t);
 
 /* (As a client) sending requests:
  *
@@ -336,6 +467,13 @@ int cno_write_data     (struct cno_connection_t *, uint32_t, const char *, size_
 int cno_write_ping     (struct cno_connection_t *, const char[8]);
 int cno_write_frame    (struct cno_connection_t *conn, const struct cno_frame_t *frame);
 
+/* Pre-encode headers that are sent with many messages, e.g. `server` or `content-type`.
+ * Pseudo-headers are not allowed. To use, set the `tmpl` of a message to the result.
+ * The template must not be modified or cleared while any `cno_write_*` call is using it,
+ * but can be shared between any number of connections and messages otherwise. */
+int  cno_header_template_init  (struct cno_header_template_t *, const struct cno_header_t *, size_t);
+void cno_header_template_clear (struct cno_header_template_t *);
+
 /* By default, cno assumes that `on_message_data` does not retain the data after returning.
    If it does copy the data somewhere, you should enable manual stream-level flow control,
    then ask to increase the window once the copy is deallocated. */
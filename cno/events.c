@@ -0,0 +1,197 @@
+#include "events.h"
+
+
+static int cno_event_push(struct cno_event_queue_t *q, struct cno_event_t ev)
+{
+    return cno_buffer_dyn_concat(&q->events, (struct cno_buffer_t) { (const char *) &ev, sizeof(ev) });
+}
+
+
+/* Drop the payloads stored before a position. Positions count from the first byte ever
+   stored, so those of queued events stay the same; the space is reused once the buffer
+   has to grow. Only whole alignment units are dropped so that headers stay aligned. */
+static void cno_event_storage_release(struct cno_event_queue_t *q, size_t position)
+{
+    size_t n = (position - q->base) & ~(_Alignof(struct cno_header_t) - 1);
+    if (n) {
+        cno_buffer_dyn_shift(&q->storage, n);
+        q->base += n;
+    }
+}
+
+
+/* Copied headers go first, with the strings they refer to right after them in the same order;
+   their `data` pointers are only filled in by `cno_event_queue_next`. */
+static int cno_event_push_message(struct cno_event_queue_t *q, uint8_t type, uint32_t stream,
+                                  const struct cno_message_t *msg, uint32_t parent)
+{
+    if (!q->events.size)
+        // nothing refers to the old payloads anymore.
+        cno_event_storage_release(q, q->base + q->storage.size);
+
+    size_t offset = q->storage.size;
+    size_t size = msg->headers_len * sizeof(struct cno_header_t) + msg->method.size + msg->path.size;
+    for (size_t i = 0; i < msg->headers_len; i++)
+        size += msg->headers[i].name.size + msg->headers[i].value.size;
+
+    if (size) {
+        offset = (offset + _Alignof(struct cno_header_t) - 1) & ~(_Alignof(struct cno_header_t) - 1);
+        if (cno_buffer_dyn_reserve(&q->storage, offset + size))
+            return CNO_ERROR_UP();
+
+        struct cno_header_t *hs = (struct cno_header_t *) (q->storage.data + offset);
+        char *p = (char *) &hs[msg->headers_len];
+        #define COPY(b) if ((b).size) memcpy(p, (b).data, (b).size), p += (b).size
+        COPY(msg->method);
+        COPY(msg->path);
+        for (size_t i = 0; i < msg->headers_len; i++) {
+            hs[i] = (struct cno_header_t) { { NULL, msg->headers[i].name.size }, { NULL, msg->headers[i].value.size },
+                                            msg->headers[i].flags, msg->headers[i].token };
+            COPY(msg->headers[i].name);
+            COPY(msg->headers[i].value);
+        }
+        #undef COPY
+        q->storage.size = offset + size;
+    }
+
+    struct cno_message_t copy = { msg->code, { NULL, msg->method.size }, { NULL, msg->path.size }, NULL, msg->headers_len, NULL };
+    return cno_event_push(q, (struct cno_event_t) { type, stream, parent, copy, { NULL, 0 }, q->base + offset });
+}
+
+
+static int cno_event_push_data(struct cno_event_queue_t *q, uint8_t type, uint32_t stream, const char *data, size_t size)
+{
+    if (!q->events.size)
+        cno_event_storage_release(q, q->base + q->storage.size);
+
+    size_t offset = q->storage.size;
+    if (cno_buffer_dyn_concat(&q->storage, (struct cno_buffer_t) { data, size }))
+        return CNO_ERROR_UP();
+    return cno_event_push(q, (struct cno_event_t) { type, stream, 0, {0}, { NULL, size }, q->base + offset });
+}
+
+
+static int cno_event_on_stream_start(void *q, uint32_t stream)
+{
+    return cno_event_push(q, (struct cno_event_t) { CNO_EVENT_STREAM_START, stream, 0, {0}, {0}, 0 });
+}
+
+
+static int cno_event_on_stream_end(void *q, uint32_t stream)
+{
+    return cno_event_push(q, (struct cno_event_t) { CNO_EVENT_STREAM_END, stream, 0, {0}, {0}, 0 });
+}
+
+
+static int cno_event_on_flow_increase(void *q, uint32_t stream)
+{
+    return cno_event_push(q, (struct cno_event_t) { CNO_EVENT_FLOW_INCREASE, stream, 0, {0}, {0}, 0 });
+}
+
+
+static int cno_event_on_message_start(void *q, uint32_t stream, const struct cno_message_t *msg)
+{
+    return cno_event_push_message(q, CNO_EVENT_MESSAGE_START, stream, msg, 0);
+}
+
+
+static int cno_event_on_message_trail(void *q, uint32_t stream, const struct cno_message_t *msg)
+{
+    return cno_event_push_message(q, CNO_EVENT_MESSAGE_TRAIL, stream, msg, 0);
+}
+
+
+static int cno_event_on_message_push(void *q, uint32_t stream, const struct cno_message_t *msg, uint32_t parent)
+{
+    return cno_event_push_message(q, CNO_EVENT_MESSAGE_PUSH, stream, msg, parent);
+}
+
+
+static int cno_event_on_message_data(void *q, uint32_t stream, const char *data, size_t size)
+{
+    return cno_event_push_data(q, CNO_EVENT_MESSAGE_DATA, stream, data, size);
+}
+
+
+static int cno_event_on_message_end(void *q, uint32_t stream)
+{
+    return cno_event_push(q, (struct cno_event_t) { CNO_EVENT_MESSAGE_END, stream, 0, {0}, {0}, 0 });
+}
+
+
+static int cno_event_on_pong(void *q, const char data[8])
+{
+    return cno_event_push_data(q, CNO_EVENT_PONG, 0, data, 8);
+}
+
+
+static int cno_event_on_settings(void *q)
+{
+    return cno_event_push(q, (struct cno_event_t) { CNO_EVENT_SETTINGS, 0, 0, {0}, {0}, 0 });
+}
+
+
+void cno_event_queue_init(struct cno_event_queue_t *q, struct cno_connection_t *conn)
+{
+    *q = (struct cno_event_queue_t) { conn, NULL, CNO_BUFFER_DYN_EMPTY, CNO_BUFFER_DYN_EMPTY, 0 };
+    q->events.allocator = q->storage.allocator = conn->allocator;
+    conn->cb_data          = q;
+    conn->on_stream_start  = &cno_event_on_stream_start;
+    conn->on_stream_end    = &cno_event_on_stream_end;
+    conn->on_flow_increase = &cno_event_on_flow_increase;
+    conn->on_message_start = &cno_event_on_message_start;
+    conn->on_message_trail = &cno_event_on_message_trail;
+    conn->on_message_push  = &cno_event_on_message_push;
+    conn->on_message_data  = &cno_event_on_message_data;
+    conn->on_message_end   = &cno_event_on_message_end;
+    conn->on_pong          = &cno_event_on_pong;
+    conn->on_settings      = &cno_event_on_settings;
+}
+
+
+void cno_event_queue_clear(struct cno_event_queue_t *q)
+{
+    cno_buffer_dyn_clear(&q->events);
+    cno_buffer_dyn_clear(&q->storage);
+    q->base = 0;
+}
+
+
+int cno_event_queue_next(struct cno_event_queue_t *q, struct cno_event_t *ev)
+{
+    if (!q->events.size)
+        return 0;
+
+    memcpy(ev, q->events.data, sizeof(*ev));
+    cno_buffer_dyn_shift(&q->events, sizeof(*ev));
+
+    if (!q->storage.data)
+        // nothing had a payload or headers, so there are no pointers to fill in.
+        return 1;
+
+    switch (ev->type) {
+        case CNO_EVENT_MESSAGE_DATA:
+        case CNO_EVENT_PONG:
+            // the payloads before this one belong to events that are now invalid.
+            cno_event_storage_release(q, ev->offset);
+            ev->data.data = q->storage.data + (ev->offset - q->base);
+            break;
+
+        case CNO_EVENT_MESSAGE_START:
+        case CNO_EVENT_MESSAGE_TRAIL:
+        case CNO_EVENT_MESSAGE_PUSH: {
+            cno_event_storage_release(q, ev->offset);
+            struct cno_header_t *hs = (struct cno_header_t *) (q->storage.data + (ev->offset - q->base));
+            char *p = (char *) &hs[ev->msg.headers_len];
+            ev->msg.headers = hs;
+            ev->msg.method.data = p; p += ev->msg.method.size;
+            ev->msg.path.data   = p; p += ev->msg.path.size;
+            for (size_t i = 0; i < ev->msg.headers_len; i++) {
+                hs[i].name.data  = p; p += hs[i].name.size;
+                hs[i].value.data = p; p += hs[i].value.size;
+            }
+            break;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include "core.h"
+
+#if __cplusplus
+extern "C" {
+#endif
+
+
+enum CNO_EVENT_TYPE
+{
+    CNO_EVENT_STREAM_START,
+    CNO_EVENT_STREAM_END,
+    CNO_EVENT_FLOW_INCREASE,
+    CNO_EVENT_MESSAGE_START,
+    CNO_EVENT_MESSAGE_TRAIL,
+    CNO_EVENT_MESSAGE_PUSH,
+    CNO_EVENT_MESSAGE_DATA,
+    CNO_EVENT_MESSAGE_END,
+    CNO_EVENT_PONG,
+    CNO_EVENT_SETTINGS,
+};
+
+
+/* One of the callbacks of `cno_connection_t`, as a value; see there for what they mean. */
+struct cno_event_t
+{
+    uint8_t /* enum CNO_EVENT_TYPE */ type;
+    uint32_t stream;  // 0 for PONG, SETTINGS, and FLOW_INCREASE of the connection window
+    uint32_t parent;  // MESSAGE_PUSH: the stream of the request that caused the push
+    struct cno_message_t msg;  // MESSAGE_START, MESSAGE_TRAIL, MESSAGE_PUSH
+    struct cno_buffer_t data;  // MESSAGE_DATA: a chunk of payload; PONG: the 8 bytes of the ping
+
+    /* Private. */
+    size_t offset;
+};
+
+
+/* Receiving events in batches instead of through callbacks:
+ *
+ *  cno_connection_init(conn, ...)
+ *  cno_event_queue_init(queue, conn)
+ *  conn.on_write = ...  -- gets `queue` as the first argument, `queue.data` is free for use
+ *  cno_connection_made(conn, ...)
+ *  while (i/o is open) {
+ *      cno_connection_data_received(conn, ...)
+ *      while (cno_event_queue_next(queue, &event)) {
+ *          switch (event.type) ...
+ *      }
+ *  }
+ *  cno_connection_lost(conn)
+ *  cno_connection_reset(conn)
+ *  cno_event_queue_clear(queue)
+ *
+ * Each event is recorded with a copy of its message and payload, so a single call into the
+ * library can produce any number of them. The copies are released as events are taken out,
+ * so even if the queue is never completely drained, the storage is bounded by the copies
+ * of the events still in it (times CNO_BUFFER_ALLOC_MIN_EXP, or plus CNO_BUFFER_ALLOC_MIN)
+ * rather than by everything that has passed through; the memory itself is only returned
+ * by `cno_event_queue_clear`. An event taken from the queue, including the message and data
+ * it points to, is valid until the next call to `cno_event_queue_next`,
+ * `cno_connection_data_received`, or `cno_write_push` (which records the pushed request
+ * as a MESSAGE_START).
+ *
+ * Events that arise from writes (e.g. STREAM_START for a new request, or STREAM_END after
+ * the last chunk of a response) are queued as well. Flow control is unchanged: unless
+ * CNO_CONN_FLAG_MANUAL_FLOW_CONTROL is set, the window is opened again as soon as data
+ * is queued. `on_write`, `on_header`, `on_frame`, `on_frame_send` and `on_upgrade` stay
+ * callbacks; the last one is called before the request that asked for the upgrade has been
+ * taken out of the queue, so servers that accept upgrades should keep using callbacks. */
+struct cno_event_queue_t
+{
+    struct cno_connection_t *conn;
+    void *data;  // for the application
+
+    /* Private. */
+    struct cno_buffer_dyn_t events;
+    struct cno_buffer_dyn_t storage;  // headers and payloads, referenced by `offset`
+    size_t base;  // the `offset` of `storage.data`
+};
+
+
+/* Take over `conn->cb_data` and the callbacks for which there is an event. */
+void cno_event_queue_init  (struct cno_event_queue_t *, struct cno_connection_t *);
+void cno_event_queue_clear (struct cno_event_queue_t *);
+/* Move the oldest event into `event` and return 1, or return 0 if there are none. */
+int  cno_event_queue_next  (struct cno_event_queue_t *, struct cno_event_t *);
+
+#if __cplusplus
+}
+#endif
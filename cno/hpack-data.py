@@ -1,4 +1,5 @@
 import os
+import re
 import textwrap
 import itertools
 
@@ -114,6 +115,31 @@ STATIC_TABLE = [
 ]
 
 
+# names that get a token (see `enum CNO_HEADER_TOKEN` in hpack.h, which must have
+# a value for each of these) in addition to those in the static table. order does not matter.
+EXTRA_TOKENS = [
+    ":protocol", "alt-svc", "connection", "content-security-policy", "early-data",
+    "grpc-accept-encoding", "grpc-encoding", "grpc-message", "grpc-status", "grpc-timeout",
+    "http2-settings", "keep-alive", "origin", "priority", "proxy-connection", "te",
+    "upgrade", "upgrade-insecure-requests", "x-content-type-options", "x-forwarded-for",
+    "x-forwarded-proto", "x-frame-options", "x-request-id", "x-xss-protection",
+]
+
+
+def token(name):
+    return 'CNO_TOKEN_' + name.lstrip(':').upper().replace('-', '_')
+
+
+def tokens_by_length(names):
+    names = sorted(set(names), key=lambda k: (len(k), k))
+    offsets = [0] * (len(names[-1]) + 2)
+    for k in names:
+        offsets[len(k) + 1] += 1
+    for i in range(1, len(offsets)):
+        offsets[i] += offsets[i - 1]
+    return names, offsets
+
+
 def huffman_dfa(table, bits_per_step):
     '''
         Initial state:    `(0, 0, HUFFMAN_ACCEPT)`
@@ -162,6 +188,29 @@ def huffman_dfa(table, bits_per_step):
                 HUFFMAN_APPEND * (char is not None))
 
 
+def check_token_enum(path, names):
+    # the enum is public, so it's written by hand; make sure it has exactly one
+    # value per name, and that pseudo-headers are the ones below CNO_TOKEN_FIRST_REGULAR.
+    with open(path) as fd:
+        body = re.search(r'enum CNO_HEADER_TOKEN\s*{(.*?)}', fd.read(), re.S).group(1)
+    body = re.sub(r'//.*', '', body)
+    values = re.findall(r'^\s*(CNO_TOKEN_\w+)', body, re.M)
+    values.remove('CNO_TOKEN_UNKNOWN')
+    split = values.index('CNO_TOKEN_FIRST_REGULAR')
+    pseudo, regular = values[:split], values[split + 1:]
+    for kind, have, want in (
+        ('pseudo-header', pseudo,  [token(k) for k in names if k.startswith(':')]),
+        ('regular',       regular, [token(k) for k in names if not k.startswith(':')]),
+    ):
+        if sorted(have) != sorted(want):
+            raise SystemExit('{}: {} tokens do not match hpack-data.py: missing {}, unexpected {}'.format(
+                path, kind, sorted(set(want) - set(have)) or '-', sorted(set(have) - set(want)) or '-'))
+
+
+TOKEN_NAMES, TOKEN_OFFSETS = tokens_by_length([k for k, _ in STATIC_TABLE] + EXTRA_TOKENS)
+check_token_enum(os.path.join(os.path.dirname(__file__), 'hpack.h'), TOKEN_NAMES)
+
+
 with open(os.path.join(os.path.dirname(__file__), 'hpack-data.h'), 'w') as fd:
     fd.write(
         '#pragma once\n' + textwrap.dedent('''
@@ -174,14 +223,21 @@ with open(os.path.join(os.path.dirname(__file__), 'hpack-data.h'), 'w') as fd:
             CNO_HUFFMAN_ACCEPT = {},
             CNO_HUFFMAN_APPEND = {},
             CNO_HUFFMAN_INPUT_BITS = {},
+            CNO_HEADER_TOKEN_MAX_LENGTH = {},
         }};
 
+        // names with tokens, sorted by length; those of length n are at [OFFSETS[n]:OFFSETS[n+1]]
+        static const struct cno_header_t CNO_HEADER_TOKEN_NAMES[] = {{ {} }};
+        static const uint8_t CNO_HEADER_TOKEN_OFFSETS[] = {{ {} }};
+
         static const struct cno_header_t CNO_HPACK_STATIC_TABLE[]  = {{ {} }};
         static const struct cno_huffman_item_t CNO_HUFFMAN_TABLE[] = {{ {} }};
         static const struct cno_huffman_leaf_t CNO_HUFFMAN_TREES[] = {{ {} }};
         ''').format(
-            len(STATIC_TABLE), HUFFMAN_ACCEPT, HUFFMAN_APPEND, HUFFMAN_INPUT_BITS,
-            ','.join('{{"%s",%s},{"%s",%s},0}' % (k, len(k), v, len(v)) for k, v in STATIC_TABLE),
+            len(STATIC_TABLE), HUFFMAN_ACCEPT, HUFFMAN_APPEND, HUFFMAN_INPUT_BITS, len(TOKEN_OFFSETS) - 2,
+            ','.join('{{"%s",%s},{"",0},0,%s}' % (k, len(k), token(k)) for k in TOKEN_NAMES),
+            ','.join('%s' % i for i in TOKEN_OFFSETS),
+            ','.join('{{"%s",%s},{"%s",%s},0,%s}' % (k, len(k), v, len(v), token(k)) for k, v in STATIC_TABLE),
             ','.join('{%s,%s}'    % h for h in HUFFMAN),
             ','.join('{%s,%s,%s}' % h for h in huffman_dfa(HUFFMAN, HUFFMAN_INPUT_BITS)),
         )
@@ -3,38 +3,106 @@
 #include "hpack-data.h"
 
 
+uint8_t cno_header_token(const struct cno_buffer_t name)
+{
+    if (name.size > CNO_HEADER_TOKEN_MAX_LENGTH)
+        return CNO_TOKEN_UNKNOWN;
+
+    for (size_t i = CNO_HEADER_TOKEN_OFFSETS[name.size]; i < CNO_HEADER_TOKEN_OFFSETS[name.size + 1]; i++)
+        if (!memcmp(CNO_HEADER_TOKEN_NAMES[i].name.data, name.data, name.size))
+            return CNO_HEADER_TOKEN_NAMES[i].token;
+
+    return CNO_TOKEN_UNKNOWN;
+}
+
+
 void cno_hpack_init(struct cno_hpack_t *state, uint32_t limit)
 {
+    *state = (struct cno_hpack_t) {
+        .limit            = limit,
+        .limit_upper      = limit,
+        .limit_update_min = limit,
+        .limit_update_end = limit,
+        .limit_list       = -1,
+    };
     cno_list_init(state);
-    state->size = 0;
-    state->limit            = \
-    state->limit_upper      = \
-    state->limit_update_min = \
-    state->limit_update_end = limit;
 }
 
 
-static void cno_hpack_evict(struct cno_hpack_t *state, uint32_t limit)
+/* Remove the oldest entries until the table fits into `limit`. If `keep` is not NULL,
+   the entries are moved there instead of being freed. */
+static void cno_hpack_evict(struct cno_hpack_t *state, uint32_t limit, struct cno_header_table_t **keep)
 {
     while (state->size > limit) {
         struct cno_header_table_t *entry = state->last;
         state->size -= entry->k_size + entry->v_size + 32;
+        if (state->budget)
+            state->budget->used -= entry->k_size + entry->v_size + 32;
         cno_list_remove(entry);
-        free(entry);
+        if (keep) {
+            entry->next = *keep;
+            *keep = entry;
+        } else
+            cno_free(state->allocator, entry);
+    }
+}
+
+
+static void cno_hpack_free_evicted(struct cno_hpack_t *state)
+{
+    for (struct cno_header_table_t *next; state->evicted; state->evicted = next) {
+        next = state->evicted->next;
+        cno_free(state->allocator, state->evicted);
     }
 }
 
 
+void cno_hpack_release(struct cno_hpack_t *state)
+{
+    cno_hpack_free_evicted(state);
+    cno_buffer_dyn_clear(&state->huffman);
+}
+
+
 void cno_hpack_clear(struct cno_hpack_t *state)
 {
-    cno_hpack_evict(state, 0);
+    cno_hpack_evict(state, 0, NULL);
+    cno_hpack_release(state);
+}
+
+
+void cno_hpack_set_budget(struct cno_hpack_t *state, struct cno_hpack_budget_t *budget)
+{
+    if (state->budget) {
+        state->budget->used -= state->size;
+        state->budget->tables--;
+    }
+    if ((state->budget = budget)) {
+        budget->used += state->size;
+        budget->tables++;
+    }
+}
+
+
+uint32_t cno_hpack_budget_target(const struct cno_hpack_budget_t *budget, uint32_t current, uint32_t max)
+{
+    if (budget->used > budget->limit) {
+        size_t share = budget->limit / (budget->tables ? budget->tables : 1);
+        return share < current ? share : current;
+    }
+    // grow slowly so that everyone doesn't overshoot at once.
+    if (budget->used < budget->limit / 4 * 3 && current < max) {
+        uint64_t next = current < 128 ? 256 : (uint64_t) current * 2;
+        return next < max ? next : max;
+    }
+    return current < max ? current : max;
 }
 
 
 void cno_hpack_setlimit(struct cno_hpack_t *state, uint32_t limit)
 {
     if (state->limit_update_min > limit)
-        cno_hpack_evict(state, state->limit_update_min = limit);
+        cno_hpack_evict(state, state->limit_update_min = limit, NULL);
 
     // the update will be encoded the next time we send a header block.
     state->limit_update_end = limit;
@@ -53,25 +121,29 @@ static struct cno_buffer_t cno_header_table_v(const struct cno_header_table_t *t
 }
 
 
-/* Insert a header into the index table. */
-static int cno_hpack_index(struct cno_hpack_t *state, const struct cno_header_t *h)
+/* Insert a header into the index table. `keep` is passed to `cno_hpack_evict`. */
+static int cno_hpack_index(struct cno_hpack_t *state, const struct cno_header_t *h,
+                           struct cno_header_table_t **keep)
 {
     size_t recorded = h->name.size + h->value.size + 32;
     size_t actual   = h->name.size + h->value.size + sizeof(struct cno_header_table_t);
 
     if (recorded > state->limit)
-        cno_hpack_evict(state, 0);
+        cno_hpack_evict(state, 0, keep);
     else {
-        cno_hpack_evict(state, state->limit - recorded);
-
-        struct cno_header_table_t *entry = malloc(actual);
+        struct cno_header_table_t *entry = cno_malloc(state->allocator, actual);
 
         if (entry == NULL)
             return CNO_ERROR(NO_MEMORY, "%zu bytes", actual);
 
-        state->size += recorded;
+        // the name may point into an entry that is about to be evicted, so copy first.
+        entry->token = h->token ? h->token : cno_header_token(h->name);
         memcpy(&entry->data[0],            h->name.data,  entry->k_size = h->name.size);
         memcpy(&entry->data[h->name.size], h->value.data, entry->v_size = h->value.size);
+        cno_hpack_evict(state, state->limit - recorded, keep);
+        state->size += recorded;
+        if (state->budget)
+            state->budget->used += recorded;
         cno_list_append(state, entry);
     }
 
@@ -102,6 +174,7 @@ static int cno_hpack_lookup(struct cno_hpack_t *state, size_t index, struct cno_
     out->name  = cno_header_table_k(hdr);
     out->value = cno_header_table_v(hdr);
     out->flags = 0;
+    out->token = hdr->token;
     return CNO_OK;
 }
 
@@ -129,6 +202,70 @@ static int cno_hpack_index_of(struct cno_hpack_t *state, const struct cno_header
 }
 
 
+#if CNO_HPACK_NAME_STATS
+static struct cno_hpack_name_stats_t * cno_hpack_name_stats(struct cno_hpack_t *state, const struct cno_buffer_t name)
+{
+    uint32_t hash = 2166136261u;  // fnv-1a
+    for (const uint8_t *p = (const uint8_t *) name.data, *e = p + name.size; p != e; p++)
+        hash = (hash ^ *p) * 16777619u;
+    return &state->names[hash % CNO_HPACK_NAME_STATS];
+}
+#endif
+
+
+/* headers that (almost) never have the same value twice. */
+static const struct cno_buffer_t CNO_HPACK_VOLATILE_NAMES[] = {
+    { ":path",             5 },
+    { "age",               3 },
+    { "content-length",   14 },
+    { "content-range",    13 },
+    { "date",              4 },
+    { "etag",              4 },
+    { "expires",           7 },
+    { "if-modified-since",17 },
+    { "if-none-match",    13 },
+    { "last-modified",    13 },
+    { "x-request-id",     12 },
+};
+
+
+int cno_hpack_policy_always(void *data __attribute__((unused)),
+                            struct cno_hpack_t *state __attribute__((unused)),
+                            const struct cno_header_t *h __attribute__((unused)))
+{
+    return 1;
+}
+
+
+int cno_hpack_policy_default(void *data __attribute__((unused)),
+                             struct cno_hpack_t *state, const struct cno_header_t *h)
+{
+    for (size_t i = 0; i < sizeof(CNO_HPACK_VOLATILE_NAMES) / sizeof(*CNO_HPACK_VOLATILE_NAMES); i++)
+        if (cno_buffer_eq(h->name, CNO_HPACK_VOLATILE_NAMES[i]))
+            return 0;
+
+    // would evict a big chunk of the table, which probably has more useful stuff in it.
+    if (h->name.size + h->value.size + 32 > state->limit / 4)
+        return 0;
+
+#if CNO_HPACK_NAME_STATS
+    struct cno_hpack_name_stats_t *st = cno_hpack_name_stats(state, h->name);
+
+    // forget old history so that names that became reusable are eventually indexed again.
+    if (st->inserts >= 256) {
+        st->inserts /= 2;
+        st->hits    /= 2;
+    }
+
+    // less than 1 reference per 8 insertions => not worth the space. still insert
+    // once in a while, though, to notice if that changes.
+    if (st->inserts >= 16 && st->hits * 8 < st->inserts && ++st->skipped % 32)
+        return 0;
+#endif
+    return 1;
+}
+
+
 static int cno_hpack_decode_uint(struct cno_buffer_dyn_t *source, uint8_t mask, size_t *out)
 {
     if (!source->size)
@@ -154,7 +291,11 @@ static int cno_hpack_decode_uint(struct cno_buffer_dyn_t *source, uint8_t mask,
 }
 
 
-static int cno_hpack_decode_string(struct cno_buffer_dyn_t *source, struct cno_buffer_t *out, int *borrow)
+/* Huffman-coded strings are decoded into `state->huffman`, which the caller has already
+   made large enough for the whole block; the rest point into the source buffer. If `skip`
+   is set, the string is not needed, so it is not decoded and `out` is left empty. */
+static int cno_hpack_decode_string(struct cno_hpack_t *state, struct cno_buffer_dyn_t *source,
+                                   struct cno_buffer_t *out, int skip)
 {
     if (!source->size)
         return CNO_ERROR(COMPRESSION, "expected string, got EOF");
@@ -168,40 +309,36 @@ static int cno_hpack_decode_string(struct cno_buffer_dyn_t *source, struct cno_b
     if (length > source->size)
         return CNO_ERROR(COMPRESSION, "expected %zu octets, got %zu", length, source->size);
 
-    if (length && huffman) {
+    if (skip) {
+        *out = CNO_BUFFER_EMPTY;
+    } else if (length && huffman) {
         const uint8_t *src = (const uint8_t *) source->data;
         const uint8_t *end = length + src;
-        // min. length of a Huffman code = 5 bits => max length after decoding = x * 8 / 5.
-        uint8_t *buf = malloc(length * 2);
+        uint8_t *buf = (uint8_t *) state->huffman.data + state->huffman.size;
         uint8_t *ptr = buf;
 
-        if (!buf)
-            return CNO_ERROR(NO_MEMORY, "%zu bytes", length * 2);
-
-        struct cno_huffman_leaf_t state = { 0, 0, CNO_HUFFMAN_ACCEPT };
+        struct cno_huffman_leaf_t leaf = { 0, 0, CNO_HUFFMAN_ACCEPT };
 
         do {
             uint8_t chr = *src++;
 
             for (int i = 0; i < 8 / CNO_HUFFMAN_INPUT_BITS; i++, chr <<= CNO_HUFFMAN_INPUT_BITS) {
-                state = CNO_HUFFMAN_TREES[state.next | (chr >> (8 - CNO_HUFFMAN_INPUT_BITS))];
+                leaf = CNO_HUFFMAN_TREES[leaf.next | (chr >> (8 - CNO_HUFFMAN_INPUT_BITS))];
 
-                if (state.flags & CNO_HUFFMAN_APPEND)
-                    *ptr++ = state.byte;
+                if (leaf.flags & CNO_HUFFMAN_APPEND)
+                    *ptr++ = leaf.byte;
             }
         } while (src != end);
 
-        if (!(state.flags & CNO_HUFFMAN_ACCEPT)) {
-            free(buf);
+        if (!(leaf.flags & CNO_HUFFMAN_ACCEPT))
             return CNO_ERROR(COMPRESSION, "invalid or truncated Huffman code");
-        }
 
         out->data = (char *) buf;
         out->size = ptr - buf;
+        state->huffman.size += ptr - buf;
     } else {
         out->data = source->data;
         out->size = length;
-        *borrow = 1;
     }
 
     cno_buffer_dyn_shift(source, length);
@@ -209,9 +346,11 @@ static int cno_hpack_decode_string(struct cno_buffer_dyn_t *source, struct cno_b
 }
 
 
+/* discard:: the header will be thrown away, so only do what is needed to update the table. */
 static int cno_hpack_decode_one(struct cno_hpack_t      *state,
                                 struct cno_buffer_dyn_t *source,
-                                struct cno_header_t     *target)
+                                struct cno_header_t     *target,
+                                int                      discard)
 {
     *target = CNO_HEADER_EMPTY;
 
@@ -223,8 +362,14 @@ static int cno_hpack_decode_one(struct cno_hpack_t      *state,
 
     if (*source->data & 0x80) {
         // 1....... -- name & value taken from the table
-        return cno_hpack_decode_uint(source, 0x7F, &index)
-            || cno_hpack_lookup(state, index, target);
+        if (cno_hpack_decode_uint(source, 0x7F, &index) || cno_hpack_lookup(state, index, target))
+            return CNO_ERROR_UP();
+
+        if (index <= CNO_HPACK_STATIC_TABLE_SIZE)
+            state->stats.static_hits++;
+        else
+            state->stats.dynamic_hits++;
+        return CNO_OK;
     } else if ((*source->data & 0xC0) == 0x40) {
         // 01...... -- name taken from the table, value included as a literal
         if (cno_hpack_decode_uint(source, 0x3F, &index))
@@ -241,47 +386,48 @@ static int cno_hpack_decode_one(struct cno_hpack_t      *state,
             return CNO_ERROR_UP();
     }
 
-    if (index == 0) {
-        int borrow = 0;
+    // a header that is not indexed can't affect the table.
+    int skip = discard && flags & CNO_HEADER_NOT_INDEXED;
 
-        if (cno_hpack_decode_string(source, &target->name, &borrow))
+    if (index == 0) {
+        if (cno_hpack_decode_string(state, source, &target->name, skip))
             return CNO_ERROR_UP();
 
-        if (!borrow)
-            flags |= CNO_HEADER_OWNS_NAME;
+        target->token = cno_header_token(target->name);
     } else {
         if (cno_hpack_lookup(state, index, target))
             return CNO_ERROR_UP();
     }
 
     target->flags = flags;
-    int borrow = 0;
 
-    if (cno_hpack_decode_string(source, &target->value, &borrow)) {
-        cno_hpack_free_header(target);
+    if (cno_hpack_decode_string(state, source, &target->value, skip))
         return CNO_ERROR_UP();
-    }
-
-    if (!borrow)
-        target->flags |= CNO_HEADER_OWNS_VALUE;
 
     if (!(flags & CNO_HEADER_NOT_INDEXED)) {
-        if (cno_hpack_index(state, target)) {
-            cno_hpack_free_header(target);
+        // headers decoded earlier in this block may point into the entries being evicted.
+        if (cno_hpack_index(state, target, &state->evicted))
             return CNO_ERROR_UP();
-        }
+
+        state->stats.inserts++;
     }
 
     return CNO_OK;
 }
 
 
-int cno_hpack_decode(struct cno_hpack_t *state, struct cno_buffer_t s,
-                     struct cno_header_t *rs, size_t *n)
+int cno_hpack_decode_each(struct cno_hpack_t *state, struct cno_buffer_t s, size_t max,
+                          int (*fn)(void *, const struct cno_header_t *), void *data)
 {
-    struct cno_buffer_dyn_t buf = {{s}, 0, 0};
-    struct cno_header_t *ptr =  rs;
-    struct cno_header_t *end = &rs[*n];
+    struct cno_buffer_dyn_t buf = {{s}, 0, 0, NULL};
+
+    // min. length of a Huffman code = 5 bits => max length after decoding = x * 8 / 5.
+    // reserving that much in advance means pointers into this buffer stay valid.
+    cno_hpack_free_evicted(state);
+    state->huffman.size = 0;
+    state->huffman.allocator = state->allocator;
+    if (cno_buffer_dyn_reserve(&state->huffman, s.size * 8 / 5 + 1))
+        return CNO_ERROR_UP();
 
     while (buf.size && (*buf.data & 0xE0) == 0x20) {
         // 001..... -- a new size limit for the table
@@ -293,19 +439,60 @@ int cno_hpack_decode(struct cno_hpack_t *state, struct cno_buffer_t s,
         if (limit > state->limit_upper)
             return CNO_ERROR(COMPRESSION, "requested table size is too big");
 
-        cno_hpack_evict(state, state->limit = limit);
+        cno_hpack_evict(state, state->limit = limit, NULL);
     }
 
-    for (; buf.size; ptr++) {
-        if (ptr == end)
-            return CNO_ERROR(COMPRESSION, "header list too long");
+    // once the list is over a limit, the rest of the block is only decoded as far as
+    // necessary to keep the dynamic table in sync with the encoder.
+    struct cno_header_t h;
+    size_t count = 0;
+    size_t list_size = 0;
+    int over_limit = 0;
 
-        if (cno_hpack_decode_one(state, &buf, ptr)) {
-            while (ptr > rs)
-                cno_hpack_free_header(--ptr);
+    while (buf.size) {
+        int discard = over_limit || count == max;
 
+        if (cno_hpack_decode_one(state, &buf, &h, discard))
             return CNO_ERROR_UP();
+
+        if (discard || (list_size += h.name.size + h.value.size + 32) > state->limit_list) {
+            over_limit = 1;
+            continue;
         }
+
+        state->stats.plain += h.name.size + h.value.size;
+        count++;
+
+        if (fn(data, &h))
+            return CNO_ERROR_UP();
+    }
+
+    state->stats.headers += count;
+    state->stats.encoded += s.size;
+
+    if (over_limit)
+        return CNO_ERROR(TOO_LARGE, "header list exceeds %zu entries or %zu octets",
+                         max, (size_t) state->limit_list);
+
+    return CNO_OK;
+}
+
+
+static int cno_hpack_decode_append(void *data, const struct cno_header_t *h)
+{
+    *(*(struct cno_header_t **) data)++ = *h;
+    return CNO_OK;
+}
+
+
+int cno_hpack_decode(struct cno_hpack_t *state, struct cno_buffer_t s,
+                     struct cno_header_t *rs, size_t *n)
+{
+    struct cno_header_t *ptr = rs;
+
+    if (cno_hpack_decode_each(state, s, *n, &cno_hpack_decode_append, &ptr)) {
+        *n = 0;
+        return CNO_ERROR_UP();
     }
 
     *n = ptr - rs;
@@ -333,18 +520,24 @@ static int cno_hpack_encode_uint(struct cno_buffer_dyn_t *buf, uint8_t prefix, u
 
 static int cno_hpack_encode_string(struct cno_buffer_dyn_t *buf, const struct cno_buffer_t s)
 {
-    if (!s.size)
-        goto huffman_inefficient;
+    const uint8_t *src = (const uint8_t *) s.data;
+    const uint8_t *end = src + s.size;
 
-    uint8_t *out = malloc(s.size);
-    uint8_t *ptr = out;
+    // the length prefix goes first, so compute the encoded length before encoding.
+    size_t length = 0;
+    for (const uint8_t *it = src; it != end; it++)
+        length += CNO_HUFFMAN_TABLE[*it].bits;
+    length = (length + 7) / 8;
 
-    if (out == NULL)
-        return CNO_ERROR(NO_MEMORY, "%zu bytes", s.size);
+    if (length >= s.size)
+        return cno_hpack_encode_uint(buf, 0, 0x7F, s.size)
+            || cno_buffer_dyn_concat(buf, s);
 
-    const uint8_t *src = (const uint8_t *) s.data;
-    const uint8_t *end = src + s.size;
+    if (cno_hpack_encode_uint(buf, 0x80, 0x7F, length)
+     || cno_buffer_dyn_reserve(buf, buf->size + length))
+        return CNO_ERROR_UP();
 
+    uint8_t *ptr = (uint8_t *) buf->data + buf->size;
     uint64_t bits = 0;
     uint8_t  used = 0;
 
@@ -354,41 +547,51 @@ static int cno_hpack_encode_string(struct cno_buffer_dyn_t *buf, const struct cn
         bits  = it.code | bits << it.bits;
         used += it.bits;
 
-        while (used >= 8) {
+        while (used >= 8)
             *ptr++ = bits >> (used -= 8);
-
-            if (ptr == out + s.size) {
-                free(out);
-                goto huffman_inefficient;
-            }
-        }
     }
 
     if (used)
         *ptr++ = (0xff | bits << 8) >> used;
 
-    int err = cno_hpack_encode_uint(buf, 0x80, 0x7F, ptr - out)
-           || cno_buffer_dyn_concat(buf, (struct cno_buffer_t) { (char *) out, ptr - out });
-
-    free(out);
-    return err;
-
-huffman_inefficient:
-    return cno_hpack_encode_uint(buf, 0, 0x7F, s.size)
-        || cno_buffer_dyn_concat(buf, s);
+    buf->size += length;
+    return CNO_OK;
 }
 
 
 static int cno_hpack_encode_one(struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf, const struct cno_header_t *h)
 {
+    state->stats.headers++;
+    state->stats.plain += h->name.size + h->value.size;
+
     int index = cno_hpack_index_of(state, h);
-    if (index < 0)
+    if (index < 0) {
+        if (-index <= CNO_HPACK_STATIC_TABLE_SIZE)
+            state->stats.static_hits++;
+        else {
+            state->stats.dynamic_hits++;
+#if CNO_HPACK_NAME_STATS
+            cno_hpack_name_stats(state, h->name)->hits++;
+#endif
+        }
         return cno_hpack_encode_uint(buf, 0x80, 0x7F, -index);
+    }
 
-    if (h->flags & CNO_HEADER_NOT_INDEXED
-        ? cno_hpack_encode_uint(buf, 0x10, 0x0F, index)
-        : cno_hpack_encode_uint(buf, 0x40, 0x3F, index) || cno_hpack_index(state, h))
+    if (h->flags & CNO_HEADER_NOT_INDEXED) {
+        if (cno_hpack_encode_uint(buf, 0x10, 0x0F, index))
+            return CNO_ERROR_UP();
+    } else if (!(state->policy ? state->policy : &cno_hpack_policy_default)(state->policy_data, state, h)) {
+        if (cno_hpack_encode_uint(buf, 0x00, 0x0F, index))
             return CNO_ERROR_UP();
+    } else {
+        if (cno_hpack_encode_uint(buf, 0x40, 0x3F, index) || cno_hpack_index(state, h, NULL))
+            return CNO_ERROR_UP();
+
+        state->stats.inserts++;
+#if CNO_HPACK_NAME_STATS
+        cno_hpack_name_stats(state, h->name)->inserts++;
+#endif
+    }
 
     if (!index)
         if (cno_hpack_encode_string(buf, h->name))
@@ -401,13 +604,16 @@ static int cno_hpack_encode_one(struct cno_hpack_t *state, struct cno_buffer_dyn
 int cno_hpack_encode(struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf,
                const struct cno_header_t *headers, size_t n)
 {
+    size_t initial_size = buf->size;
+
     // force the other side to evict the same number of entries first
-    if (state->limit != state->limit_update_min)
-        if (cno_hpack_encode_uint(buf, 0x20, 0x1F, state->limit_update_min))
+    uint32_t limit = state->limit;
+    if (limit != state->limit_update_min)
+        if (cno_hpack_encode_uint(buf, 0x20, 0x1F, limit = state->limit_update_min))
             return CNO_ERROR_UP();
 
     // only then set the limit to its actual value
-    if (state->limit != state->limit_update_end)
+    if (limit != state->limit_update_end)
         if (cno_hpack_encode_uint(buf, 0x20, 0x1F, state->limit_update_end))
             return CNO_ERROR_UP();
 
@@ -417,5 +623,89 @@ int cno_hpack_encode(struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf,
         if (cno_hpack_encode_one(state, buf, headers++))
             return CNO_ERROR_UP();
 
+    state->stats.encoded += buf->size - initial_size;
+    return CNO_OK;
+}
+
+
+static int cno_hpack_policy_never(void *data __attribute__((unused)),
+                                  struct cno_hpack_t *state __attribute__((unused)),
+                                  const struct cno_header_t *h __attribute__((unused)))
+{
+    return 0;
+}
+
+
+int cno_hpack_encode_static(struct cno_buffer_dyn_t *buf, const struct cno_header_t *headers, size_t n)
+{
+    // an empty table that refuses to grow => only static table indices and non-indexed literals.
+    struct cno_hpack_t empty;
+    cno_hpack_init(&empty, 0);
+    empty.policy = &cno_hpack_policy_never;
+
+    while (n--)
+        if (cno_hpack_encode_one(&empty, buf, headers++))
+            return CNO_ERROR_UP();
+
+    return CNO_OK;
+}
+
+
+int cno_hpack_save(const struct cno_hpack_t *state, struct cno_buffer_dyn_t *buf)
+{
+    uint64_t count = 0;
+    for (const struct cno_header_table_t *t = state->first; t != cno_list_end(state); t = t->next)
+        count++;
+
+    if (cno_buffer_dyn_put_uint(buf, state->limit)
+     || cno_buffer_dyn_put_uint(buf, state->limit_upper)
+     || cno_buffer_dyn_put_uint(buf, state->limit_update_min)
+     || cno_buffer_dyn_put_uint(buf, state->limit_update_end)
+     || cno_buffer_dyn_put_uint(buf, state->limit_list)
+     || cno_buffer_dyn_put_uint(buf, count))
+        return CNO_ERROR_UP();
+
+    // oldest first, so that loading can simply index them again.
+    for (const struct cno_header_table_t *t = state->last; t != cno_list_end(state); t = t->prev)
+        if (cno_buffer_dyn_put_str(buf, cno_header_table_k(t))
+         || cno_buffer_dyn_put_str(buf, cno_header_table_v(t)))
+            return CNO_ERROR_UP();
+
+    return CNO_OK;
+}
+
+
+int cno_hpack_load(struct cno_hpack_t *state, struct cno_buffer_t *buf)
+{
+    uint64_t limits[5], count;
+    for (size_t i = 0; i < 5; i++)
+        if (cno_buffer_get_uint(buf, &limits[i]))
+            return CNO_ERROR_UP();
+        else if (limits[i] > UINT32_MAX)
+            return CNO_ERROR(ASSERTION, "invalid HPACK table limit");
+
+    if (state->size)
+        return CNO_ERROR(ASSERTION, "HPACK table is not empty");
+
+    state->limit            = limits[0];
+    state->limit_upper      = limits[1];
+    state->limit_update_min = limits[2];
+    state->limit_update_end = limits[3];
+    state->limit_list       = limits[4];
+
+    if (cno_buffer_get_uint(buf, &count))
+        return CNO_ERROR_UP();
+
+    for (uint64_t total = 0; count--;) {
+        struct cno_header_t h = CNO_HEADER_EMPTY;
+        if (cno_buffer_get_str(buf, &h.name) || cno_buffer_get_str(buf, &h.value))
+            return CNO_ERROR_UP();
+        // nothing may be evicted, or the table would no longer match the peer's.
+        if ((total += h.name.size + h.value.size + 32) > state->limit)
+            return CNO_ERROR(ASSERTION, "HPACK table larger than its limit");
+        if (cno_hpack_index(state, &h, NULL))
+            return CNO_ERROR_UP();
+    }
+
     return CNO_OK;
 }
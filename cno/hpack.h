@@ -8,17 +8,105 @@ extern "C" {
 
 enum CNO_HEADER_FLAGS
 {
-    CNO_HEADER_OWNS_NAME   = 0x01,  // owned strings should be free-d
-    CNO_HEADER_OWNS_VALUE  = 0x02,
     CNO_HEADER_NOT_INDEXED = 0x04,
 };
 
 
+/* Small integers identifying well-known header names, so that they can be checked
+   with a `switch` instead of a series of string comparisons. Assigned to inbound
+   headers by the HPACK decoder and the HTTP/1.x parser; ignored on outbound ones.
+   `cno/hpack-data.py` refuses to generate the name table unless these match its list. */
+enum CNO_HEADER_TOKEN
+{
+    CNO_TOKEN_UNKNOWN = 0,
+    // pseudo-headers
+    CNO_TOKEN_AUTHORITY,
+    CNO_TOKEN_METHOD,
+    CNO_TOKEN_PATH,
+    CNO_TOKEN_PROTOCOL,
+    CNO_TOKEN_SCHEME,
+    CNO_TOKEN_STATUS,
+    // regular headers; all names from the HPACK static table, plus some other common ones
+    CNO_TOKEN_FIRST_REGULAR,
+    CNO_TOKEN_ACCEPT = CNO_TOKEN_FIRST_REGULAR,
+    CNO_TOKEN_ACCEPT_CHARSET,
+    CNO_TOKEN_ACCEPT_ENCODING,
+    CNO_TOKEN_ACCEPT_LANGUAGE,
+    CNO_TOKEN_ACCEPT_RANGES,
+    CNO_TOKEN_ACCESS_CONTROL_ALLOW_ORIGIN,
+    CNO_TOKEN_AGE,
+    CNO_TOKEN_ALLOW,
+    CNO_TOKEN_ALT_SVC,
+    CNO_TOKEN_AUTHORIZATION,
+    CNO_TOKEN_CACHE_CONTROL,
+    CNO_TOKEN_CONNECTION,
+    CNO_TOKEN_CONTENT_DISPOSITION,
+    CNO_TOKEN_CONTENT_ENCODING,
+    CNO_TOKEN_CONTENT_LANGUAGE,
+    CNO_TOKEN_CONTENT_LENGTH,
+    CNO_TOKEN_CONTENT_LOCATION,
+    CNO_TOKEN_CONTENT_RANGE,
+    CNO_TOKEN_CONTENT_SECURITY_POLICY,
+    CNO_TOKEN_CONTENT_TYPE,
+    CNO_TOKEN_COOKIE,
+    CNO_TOKEN_DATE,
+    CNO_TOKEN_EARLY_DATA,
+    CNO_TOKEN_ETAG,
+    CNO_TOKEN_EXPECT,
+    CNO_TOKEN_EXPIRES,
+    CNO_TOKEN_FROM,
+    CNO_TOKEN_GRPC_ACCEPT_ENCODING,
+    CNO_TOKEN_GRPC_ENCODING,
+    CNO_TOKEN_GRPC_MESSAGE,
+    CNO_TOKEN_GRPC_STATUS,
+    CNO_TOKEN_GRPC_TIMEOUT,
+    CNO_TOKEN_HOST,
+    CNO_TOKEN_HTTP2_SETTINGS,
+    CNO_TOKEN_IF_MATCH,
+    CNO_TOKEN_IF_MODIFIED_SINCE,
+    CNO_TOKEN_IF_NONE_MATCH,
+    CNO_TOKEN_IF_RANGE,
+    CNO_TOKEN_IF_UNMODIFIED_SINCE,
+    CNO_TOKEN_KEEP_ALIVE,
+    CNO_TOKEN_LAST_MODIFIED,
+    CNO_TOKEN_LINK,
+    CNO_TOKEN_LOCATION,
+    CNO_TOKEN_MAX_FORWARDS,
+    CNO_TOKEN_ORIGIN,
+    CNO_TOKEN_PRIORITY,
+    CNO_TOKEN_PROXY_AUTHENTICATE,
+    CNO_TOKEN_PROXY_AUTHORIZATION,
+    CNO_TOKEN_PROXY_CONNECTION,
+    CNO_TOKEN_RANGE,
+    CNO_TOKEN_REFERER,
+    CNO_TOKEN_REFRESH,
+    CNO_TOKEN_RETRY_AFTER,
+    CNO_TOKEN_SERVER,
+    CNO_TOKEN_SET_COOKIE,
+    CNO_TOKEN_STRICT_TRANSPORT_SECURITY,
+    CNO_TOKEN_TE,
+    CNO_TOKEN_TRANSFER_ENCODING,
+    CNO_TOKEN_UPGRADE,
+    CNO_TOKEN_UPGRADE_INSECURE_REQUESTS,
+    CNO_TOKEN_USER_AGENT,
+    CNO_TOKEN_VARY,
+    CNO_TOKEN_VIA,
+    CNO_TOKEN_WWW_AUTHENTICATE,
+    CNO_TOKEN_X_CONTENT_TYPE_OPTIONS,
+    CNO_TOKEN_X_FORWARDED_FOR,
+    CNO_TOKEN_X_FORWARDED_PROTO,
+    CNO_TOKEN_X_FRAME_OPTIONS,
+    CNO_TOKEN_X_REQUEST_ID,
+    CNO_TOKEN_X_XSS_PROTECTION,
+};
+
+
 struct cno_header_t
 {
     struct cno_buffer_t name;
     struct cno_buffer_t value;
     uint8_t /* enum CNO_HEADER_FLAGS */ flags;
+    uint8_t /* enum CNO_HEADER_TOKEN */ token;
 };
 
 
@@ -27,10 +115,41 @@ struct cno_header_table_t
     struct cno_list_link_t(struct cno_header_table_t);
     size_t k_size;
     size_t v_size;
+    uint8_t token;
     char data[];
 };
 
 
+struct cno_hpack_stats_t
+{
+    uint64_t headers;       // total number of headers passed through
+    uint64_t static_hits;   // ...of them encoded as a reference to a static table entry
+    uint64_t dynamic_hits;  // ...or a dynamic table entry
+    uint64_t inserts;       // ...or inserted into the dynamic table
+    uint64_t plain;         // total length of names and values
+    uint64_t encoded;       // total length of header blocks
+};
+
+
+struct cno_hpack_name_stats_t
+{
+    uint16_t inserts;  // how many entries with a name with this hash were inserted
+    uint16_t hits;     // how many times such entries were referenced later
+    uint16_t skipped;  // how many times the default policy refused to insert one
+};
+
+
+/* Shared by any number of HPACK states (e.g. all connections on a thread) to bound the
+   total size of their dynamic tables. Not thread-safe. The states only keep `used` and
+   `tables` up to date; it's up to their owners to act on it, see `cno_hpack_budget_target`. */
+struct cno_hpack_budget_t
+{
+    size_t limit;   // in the units of RFC 7541 section 4.1 (32 bytes of overhead per entry)
+    size_t used;
+    size_t tables;
+};
+
+
 struct cno_hpack_t
 {
     struct cno_list_root_t(struct cno_header_table_t);
@@ -39,40 +158,82 @@ struct cno_hpack_t
     uint32_t limit_upper;
     uint32_t limit_update_min;  // only used by an encoder
     uint32_t limit_update_end;
+    uint32_t limit_list;  // decoder only: max. size of a header list, counted as in SETTINGS_MAX_HEADER_LIST_SIZE
+    struct cno_hpack_stats_t stats;
+    struct cno_buffer_dyn_t huffman;  // decoder only: Huffman-decoded strings from the last block
+    struct cno_header_table_t *evicted;  // decoder only: entries evicted while decoding it
+    /* Used for the table and `huffman`. NULL means libc. Set right after `cno_hpack_init`. */
+    const struct cno_allocator_t *allocator;
+    /* If not NULL, the size of the table is added to `budget->used`. Attach and detach
+     * with `cno_hpack_set_budget`. */
+    struct cno_hpack_budget_t *budget;
+    /* Encoder only: decides whether a header not found in the table should be inserted.
+     * Return nonzero to insert. Not consulted for headers with CNO_HEADER_NOT_INDEXED.
+     * NULL means `cno_hpack_policy_default`; `cno_hpack_policy_always` indexes everything. */
+    void *policy_data;
+    int (*policy)(void *, struct cno_hpack_t *, const struct cno_header_t *);
+#if CNO_HPACK_NAME_STATS
+    struct cno_hpack_name_stats_t names[CNO_HPACK_NAME_STATS];  // used by the default policy
+#endif
 };
 
 
-static const struct cno_header_t CNO_HEADER_EMPTY = { { NULL, 0 }, { NULL, 0 }, 0 };
+static const struct cno_header_t CNO_HEADER_EMPTY = { { NULL, 0 }, { NULL, 0 }, 0, 0 };
+
 
+/* Return the token for a (lowercase) header name, or CNO_TOKEN_UNKNOWN. */
+uint8_t cno_header_token(const struct cno_buffer_t name);
 
 void cno_hpack_init     (struct cno_hpack_t *, uint32_t limit);
 void cno_hpack_setlimit (struct cno_hpack_t *, uint32_t limit);
 void cno_hpack_clear    (struct cno_hpack_t *);
+/* Free what the decoder keeps for the headers returned by the last `cno_hpack_decode`,
+   which become invalid. Done automatically by the next decode. */
+void cno_hpack_release  (struct cno_hpack_t *);
+void cno_hpack_set_budget (struct cno_hpack_t *, struct cno_hpack_budget_t *);
+
+/* The table size that a state under `budget` should switch to, given its current size
+   and the most it may have: a fair share of the budget while it's exceeded, then twice
+   the current size once less than 3/4 of it is used, up to the maximum. */
+uint32_t cno_hpack_budget_target(const struct cno_hpack_budget_t *, uint32_t current, uint32_t max);
+
+/* Indexing policies. The default one never indexes headers known to change with each
+   message (`:path`, `date`, `content-length`, ...) and entries bigger than 1/4 of
+   the table, and stops indexing names whose entries are rarely referenced afterwards. */
+int cno_hpack_policy_default (void *, struct cno_hpack_t *, const struct cno_header_t *);
+int cno_hpack_policy_always  (void *, struct cno_hpack_t *, const struct cno_header_t *);
 
 /* Decode at most `*n` headers from a buffer into a provided array.
-   `*n` is set to the actual number of headers decoded afterwards.
-   Note: the buffer must not be free-d until all headers are also free-d. */
+   `*n` is set to the actual number of headers decoded afterwards. If there are more
+   headers, or their total size is above `limit_list`, the rest of the block is skipped
+   over (only updating the dynamic table) and the error is TOO_LARGE; unlike others,
+   this one leaves the decoder usable.
+   Note: the headers may point into the buffer, so it must outlive them. Strings that
+   were Huffman-coded or taken from the dynamic table are owned by the decoder and only
+   remain valid until the next call to `cno_hpack_decode`, `cno_hpack_release`,
+   or `cno_hpack_clear`. */
 int cno_hpack_decode(struct cno_hpack_t *, struct cno_buffer_t, struct cno_header_t *, size_t *n);
 
+/* Same as `cno_hpack_decode`, but instead of filling an array, pass each header to a callback
+   as soon as it is decoded, for at most `max` headers. The strings have the same lifetime.
+   If the callback fails, so does this, and the decoder is left in an inconsistent state. */
+int cno_hpack_decode_each(struct cno_hpack_t *, struct cno_buffer_t, size_t max,
+                          int (*)(void *, const struct cno_header_t *), void *);
+
 /* Encode exactly `n` headers into a dynamic buffer. Note: if it errors,
    the buffer may contain partially encoded data. Clear it yourself. */
 int cno_hpack_encode(struct cno_hpack_t *, struct cno_buffer_dyn_t *, const struct cno_header_t *, size_t n);
 
-#if !CFFI_CDEF_MODE
+/* Encode `n` headers using only the static table (or literals without indexing).
+   This does not depend on or modify any HPACK state, so the result can be appended
+   to the output of `cno_hpack_encode` for any encoder any number of times. */
+int cno_hpack_encode_static(struct cno_buffer_dyn_t *, const struct cno_header_t *, size_t n);
 
-/* Carefully deallocate buffers used to construct a header. (Some of them may be shared.) */
-static inline void cno_hpack_free_header(struct cno_header_t *h)
-{
-    if (h->flags & CNO_HEADER_OWNS_NAME)
-        free((void *) h->name.data);
-
-    if (h->flags & CNO_HEADER_OWNS_VALUE)
-        free((void *) h->value.data);
-
-    *h = CNO_HEADER_EMPTY;
-}
-
-#endif
+/* Append the limits and the dynamic table to a buffer, or restore them into a state that
+   has just been initialized (after setting its allocator and budget). Statistics and
+   whatever the decoder keeps for the last header block are not included. */
+int cno_hpack_save(const struct cno_hpack_t *, struct cno_buffer_dyn_t *);
+int cno_hpack_load(struct cno_hpack_t *, struct cno_buffer_t *);
 
 #if __cplusplus
 }
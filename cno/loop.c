@@ -0,0 +1,1238 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CNO_LOOP_URING 1
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include "config.h"
+#include "common.h"
+#include "loop.h"
+
+#define CNO_LOOP_EVENTS 256
+#define CNO_LOOP_OUTPUT_LIMIT (1024 * 1024)
+
+#ifndef CNO_LOOP_URING
+#define CNO_LOOP_URING 0
+#endif
+
+
+enum CNO_LOOP_CONN_FLAGS
+{
+    CNO_LOOP_READABLE = 0x01,  // there may be unread input (stopped because of `output_limit`)
+    CNO_LOOP_HUP      = 0x02,  // the peer has shut down its side; read until the end of stream
+    CNO_LOOP_CLOSING  = 0x04,  // reset, but the kernel still has operations on it (io_uring)
+    CNO_LOOP_RECV     = 0x08,  // a multishot recv is armed
+    CNO_LOOP_SEND     = 0x10,  // `sending` is being sent
+    CNO_LOOP_PAUSED   = 0x20,  // not receiving because of `output_limit`
+    CNO_LOOP_DRAIN    = 0x40,  // ignore further input, close once the output has been sent
+    CNO_LOOP_DIRTY    = 0x80,  // in the worker's list of connections with output to submit
+    CNO_LOOP_UNREF    = 0x100, // closed and no other thread has a reference
+    CNO_LOOP_STALLED  = 0x200, // a pipelined HTTP/1.x request waits for a posted response
+};
+
+
+enum CNO_LOOP_CMD_TYPE
+{
+    CNO_LOOP_CMD_MESSAGE,
+    CNO_LOOP_CMD_DATA,
+    CNO_LOOP_CMD_RESET,
+    CNO_LOOP_CMD_UNREF,
+};
+
+
+/* A write posted by another thread. Copies of the headers, strings, and payload follow. */
+struct cno_loop_cmd_t
+{
+    struct cno_loop_cmd_t *next;
+    struct cno_loop_conn_t *conn;
+    uint32_t stream;
+    uint8_t type;
+    uint8_t final;
+    enum CNO_RST_STREAM_CODE code;
+    struct cno_message_t msg;
+    struct cno_buffer_t data;  // advanced as flow control allows
+};
+
+
+#if CNO_LOOP_URING
+/* The low bits of `user_data` say what a completion is for; the rest is a pointer
+   to the connection or the worker. */
+enum CNO_LOOP_URING_OP
+{
+    CNO_LOOP_OP_RECV,
+    CNO_LOOP_OP_SEND,
+    CNO_LOOP_OP_CANCEL,
+    CNO_LOOP_OP_ACCEPT,
+    CNO_LOOP_OP_STOP,
+    CNO_LOOP_OP_WAKE,
+    CNO_LOOP_OP_MASK = 7,
+};
+
+
+struct cno_loop_ring_t
+{
+    int fd;
+    unsigned entries;
+    unsigned queued;  // SQEs filled since the last `io_uring_enter`
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *map;
+    size_t map_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buffers;
+    char *buffer_data;
+    uint16_t buffer_tail;
+};
+#endif
+
+
+struct cno_loop_worker_t
+{
+    struct cno_loop_t *loop;
+    pthread_t thread;
+    int started;
+    int epoll;
+    int listener;
+    struct cno_list_root_t(struct cno_loop_conn_t) open;
+    struct cno_list_root_t(struct cno_loop_conn_t) pool;
+    size_t pool_size;
+    struct cno_loop_conn_t *dirty;  // linked through `next_dirty`
+    struct cno_loop_cmd_t *posted;  // by other threads, newest first
+    int wake;  // eventfd, signaled when `posted` becomes non-empty
+#if CNO_LOOP_URING
+    struct cno_loop_ring_t ring;
+    int stopping;
+#endif
+    char input[CNO_LOOP_READ_SIZE];
+};
+
+
+static size_t cno_loop_output_limit(struct cno_loop_t *loop)
+{
+    return loop->output_limit ? loop->output_limit : CNO_LOOP_OUTPUT_LIMIT;
+}
+
+
+static void cno_loop_mark_dirty(struct cno_loop_conn_t *c)
+{
+    if (!(c->flags & CNO_LOOP_DIRTY)) {
+        c->flags |= CNO_LOOP_DIRTY;
+        c->next_dirty = c->worker->dirty;
+        c->worker->dirty = c;
+    }
+}
+
+
+int cno_loop_flush(struct cno_loop_conn_t *c)
+{
+    if (c->worker->loop->uring) {
+        // submitted together with everything else at the end of this iteration
+        cno_loop_mark_dirty(c);
+        return CNO_OK;
+    }
+    while (c->output.size) {
+        ssize_t n = send(c->fd, c->output.data, c->output.size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CNO_OK;  // wait for EPOLLOUT
+            return CNO_ERROR(DISCONNECT, "send: %s", strerror(errno));
+        }
+        cno_buffer_dyn_shift(&c->output, n);
+    }
+    return CNO_OK;
+}
+
+
+static int cno_loop_on_write(void *data, const char *buf, size_t size)
+{
+    struct cno_loop_conn_t *c = data;
+    if (size >= CNO_LOOP_WRITE_DIRECT) {
+        // don't copy a large payload just to send it a moment later; if the socket
+        // can't take all of it right now, only the rest is buffered.
+        // (`sendmsg` is `writev` that can be told not to raise SIGPIPE.)
+        struct iovec iov[] = { { c->output.data, c->output.size }, { (void *) buf, size } };
+        struct msghdr msg = { .msg_iov = c->output.size ? iov : iov + 1, .msg_iovlen = c->output.size ? 2 : 1 };
+        ssize_t n;
+        do
+            n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        while (n < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return CNO_ERROR(DISCONNECT, "sendmsg: %s", strerror(errno));
+        if (n > 0) {
+            size_t head = (size_t) n < c->output.size ? (size_t) n : c->output.size;
+            cno_buffer_dyn_shift(&c->output, head);
+            buf  += n - head;
+            size -= n - head;
+        }
+    }
+    return cno_buffer_dyn_concat(&c->output, (struct cno_buffer_t) { buf, size });
+}
+
+
+static int cno_loop_uring_on_write(void *data, const char *buf, size_t size)
+{
+    // the kernel reads the buffer asynchronously, so everything has to be copied.
+    struct cno_loop_conn_t *c = data;
+    cno_loop_mark_dirty(c);
+    return cno_buffer_dyn_concat(&c->output, (struct cno_buffer_t) { buf, size });
+}
+
+
+static struct cno_loop_conn_t *cno_loop_conn_new(struct cno_loop_worker_t *w, int fd)
+{
+    struct cno_loop_conn_t *c = w->pool.first;
+    if (c != cno_list_end(&w->pool)) {
+        cno_list_remove(c);
+        w->pool_size--;
+    } else if (!(c = malloc(sizeof(*c)))) {
+        return CNO_ERROR_NULL(NO_MEMORY, "%zu bytes", sizeof(*c));
+    } else if (!(c->unref = malloc(sizeof(struct cno_loop_cmd_t)))) {
+        free(c);
+        return CNO_ERROR_NULL(NO_MEMORY, "%zu bytes", sizeof(struct cno_loop_cmd_t));
+    } else {
+        c->output  = CNO_BUFFER_DYN_EMPTY;
+        c->sending = CNO_BUFFER_DYN_EMPTY;
+        c->unref->conn = c;
+        c->unref->type = CNO_LOOP_CMD_UNREF;
+    }
+
+    cno_connection_init(&c->conn, CNO_SERVER);
+    c->conn.cb_data  = c;
+    c->conn.on_write = w->loop->uring ? &cno_loop_uring_on_write : &cno_loop_on_write;
+    c->worker     = w;
+    c->next_dirty = NULL;
+    c->data       = NULL;
+    c->fd         = fd;
+    c->flags      = 0;
+    c->pending    = 0;
+    c->refs       = 1;  // held by the worker until the connection is closed
+    c->blocked    = NULL;
+    cno_list_append(&w->open, c);
+    return c;
+}
+
+
+/* Close the socket and put the object into the pool. Only once the kernel is done with it. */
+static void cno_loop_conn_release(struct cno_loop_conn_t *c)
+{
+    struct cno_loop_worker_t *w = c->worker;
+    if (c->flags & CNO_LOOP_DIRTY) {
+        struct cno_loop_conn_t **it = &w->dirty;
+        while (*it != c)
+            it = &(*it)->next_dirty;
+        *it = c->next_dirty;
+    }
+    close(c->fd);
+    cno_list_remove(c);
+    c->output.size = 0;
+    c->sending.size = 0;
+    if (w->pool_size == CNO_LOOP_POOL_SIZE) {
+        cno_buffer_dyn_clear(&c->output);
+        cno_buffer_dyn_clear(&c->sending);
+        free(c->unref);
+        free(c);
+    } else {
+        // keep the buffers unless some huge response made them grow
+        if (c->output.cap + c->output.offset > CNO_LOOP_READ_SIZE)
+            cno_buffer_dyn_clear(&c->output);
+        if (c->sending.cap + c->sending.offset > CNO_LOOP_READ_SIZE)
+            cno_buffer_dyn_clear(&c->sending);
+        cno_list_append(&w->pool, c);
+        w->pool_size++;
+    }
+}
+
+
+#if CNO_LOOP_URING
+static void cno_loop_uring_cancel_all(struct cno_loop_conn_t *);
+#endif
+
+
+/* Release a closed connection if neither the kernel nor other threads still use it. */
+static void cno_loop_conn_try_release(struct cno_loop_conn_t *c)
+{
+    if ((c->flags & CNO_LOOP_UNREF) && !c->pending)
+        cno_loop_conn_release(c);
+}
+
+
+static void cno_loop_conn_close(struct cno_loop_conn_t *c)
+{
+    if (c->flags & CNO_LOOP_CLOSING)
+        return;
+    struct cno_loop_worker_t *w = c->worker;
+    c->flags |= CNO_LOOP_CLOSING;
+    if (w->loop->on_close)
+        w->loop->on_close(w->loop->cb_data, c);
+    cno_connection_reset(&c->conn);
+    while (c->blocked) {
+        struct cno_loop_cmd_t *cmd = c->blocked;
+        c->blocked = cmd->next;
+        free(cmd);
+    }
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        c->flags |= CNO_LOOP_UNREF;
+    // otherwise, the last `cno_loop_conn_unref` posts `c->unref`
+    if (!c->pending) {
+        cno_loop_conn_try_release(c);
+        return;
+    }
+#if CNO_LOOP_URING
+    // a shutdown completes all pending receives, and sends fail with EPIPE, but a send
+    // still waiting for space in the socket buffer is only stopped by a cancellation.
+    shutdown(c->fd, SHUT_RDWR);
+    cno_loop_uring_cancel_all(c);
+#endif
+}
+
+
+/* Close everything and free all memory; the worker thread is about to exit. */
+static void cno_loop_worker_clear(struct cno_loop_worker_t *w)
+{
+    for (struct cno_loop_conn_t *c = w->open.first, *next; c != cno_list_end(&w->open); c = next) {
+        next = c->next;
+        cno_loop_conn_close(c);
+    }
+    for (struct cno_loop_cmd_t *cmd = __atomic_exchange_n(&w->posted, NULL, __ATOMIC_ACQUIRE), *next; cmd; cmd = next) {
+        next = cmd->next;
+        if (cmd->type != CNO_LOOP_CMD_UNREF)
+            free(cmd);
+    }
+    // still referenced by other threads (which should not be running anymore), or with
+    // io_uring operations that will never complete now
+    while (w->open.first != cno_list_end(&w->open)) {
+        struct cno_loop_conn_t *c = w->open.first;
+        c->pending = 0;
+        cno_loop_conn_release(c);
+    }
+    while (w->pool.first != cno_list_end(&w->pool)) {
+        struct cno_loop_conn_t *c = w->pool.first;
+        cno_list_remove(c);
+        cno_buffer_dyn_clear(&c->output);
+        cno_buffer_dyn_clear(&c->sending);
+        free(c->unref);
+        free(c);
+    }
+    w->pool_size = 0;
+}
+
+
+void cno_loop_conn_ref(struct cno_loop_conn_t *c)
+{
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+static void cno_loop_post(struct cno_loop_cmd_t *cmd)
+{
+    // once pushed, the command (and, for `c->unref`, the connection) may be gone at any moment.
+    struct cno_loop_worker_t *w = cmd->conn->worker;
+    struct cno_loop_cmd_t *head = __atomic_load_n(&w->posted, __ATOMIC_RELAXED);
+    do
+        cmd->next = head;
+    while (!__atomic_compare_exchange_n(&w->posted, &head, cmd, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!head) {
+        // the worker reads the eventfd before taking the commands, so it will see this one
+        // either now or after the next wakeup.
+        uint64_t one = 1;
+        while (write(w->wake, &one, sizeof(one)) < 0 && errno == EINTR) {}
+    }
+}
+
+
+void cno_loop_conn_unref(struct cno_loop_conn_t *c)
+{
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        cno_loop_post(c->unref);
+}
+
+
+static struct cno_loop_cmd_t *cno_loop_cmd_new(struct cno_loop_conn_t *c, uint8_t type, uint32_t stream, size_t extra)
+{
+    struct cno_loop_cmd_t *cmd = malloc(sizeof(*cmd) + extra);
+    if (!cmd)
+        return CNO_ERROR_NULL(NO_MEMORY, "%zu bytes", sizeof(*cmd) + extra);
+    cmd->conn   = c;
+    cmd->stream = stream;
+    cmd->type   = type;
+    cmd->final  = 0;
+    return cmd;
+}
+
+
+static struct cno_buffer_t cno_loop_cmd_copy(char **out, struct cno_buffer_t b)
+{
+    struct cno_buffer_t r = { *out, b.size };
+    if (b.size)
+        memcpy(*out, b.data, b.size);
+    *out += b.size;
+    return r;
+}
+
+
+int cno_loop_post_message(struct cno_loop_conn_t *c, uint32_t stream, const struct cno_message_t *msg, int final)
+{
+    size_t size = msg->headers_len * sizeof(struct cno_header_t) + msg->method.size + msg->path.size;
+    for (size_t i = 0; i < msg->headers_len; i++)
+        size += msg->headers[i].name.size + msg->headers[i].value.size;
+    struct cno_loop_cmd_t *cmd = cno_loop_cmd_new(c, CNO_LOOP_CMD_MESSAGE, stream, size);
+    if (!cmd)
+        return CNO_ERROR_UP();
+
+    struct cno_header_t *headers = (struct cno_header_t *) (cmd + 1);
+    char *out = (char *) (headers + msg->headers_len);
+    cmd->final = final;
+    cmd->msg = *msg;
+    cmd->msg.headers = headers;
+    cmd->msg.method = cno_loop_cmd_copy(&out, msg->method);
+    cmd->msg.path   = cno_loop_cmd_copy(&out, msg->path);
+    for (size_t i = 0; i < msg->headers_len; i++) {
+        headers[i] = msg->headers[i];
+        headers[i].name  = cno_loop_cmd_copy(&out, msg->headers[i].name);
+        headers[i].value = cno_loop_cmd_copy(&out, msg->headers[i].value);
+    }
+    cno_loop_post(cmd);
+    return CNO_OK;
+}
+
+
+int cno_loop_post_data(struct cno_loop_conn_t *c, uint32_t stream, const char *data, size_t size, int final)
+{
+    struct cno_loop_cmd_t *cmd = cno_loop_cmd_new(c, CNO_LOOP_CMD_DATA, stream, size);
+    if (!cmd)
+        return CNO_ERROR_UP();
+    char *out = (char *) (cmd + 1);
+    cmd->final = final;
+    cmd->data = cno_loop_cmd_copy(&out, (struct cno_buffer_t) { data, size });
+    cno_loop_post(cmd);
+    return CNO_OK;
+}
+
+
+int cno_loop_post_reset(struct cno_loop_conn_t *c, uint32_t stream, enum CNO_RST_STREAM_CODE code)
+{
+    struct cno_loop_cmd_t *cmd = cno_loop_cmd_new(c, CNO_LOOP_CMD_RESET, stream, 0);
+    if (!cmd)
+        return CNO_ERROR_UP();
+    cmd->code = code;
+    cno_loop_post(cmd);
+    return CNO_OK;
+}
+
+
+/* Returns 1 if the command has to wait for flow control or for an earlier response
+   to complete, 0 if it's done, -1 if the connection should be closed. */
+static int cno_loop_cmd_run(struct cno_loop_cmd_t *cmd)
+{
+    struct cno_connection_t *conn = &cmd->conn->conn;
+    int ret = 0;
+    switch (cmd->type) {
+        case CNO_LOOP_CMD_MESSAGE:
+            ret = cno_write_message(conn, cmd->stream, &cmd->msg, cmd->final);
+            break;
+        case CNO_LOOP_CMD_RESET:
+            ret = cno_write_reset(conn, cmd->stream, cmd->code);
+            break;
+        case CNO_LOOP_CMD_DATA:
+            if ((ret = cno_write_data(conn, cmd->stream, cmd->data.data, cmd->data.size, cmd->final)) >= 0) {
+                cmd->data.data += ret;
+                cmd->data.size -= ret;
+                return cmd->data.size != 0;
+            }
+            break;
+    }
+    if (ret < 0 && cno_error_code() == CNO_ERRNO_WOULD_BLOCK)
+        return 1;
+    // the stream was reset while the response was being prepared
+    if (ret < 0 && cno_error_code() == CNO_ERRNO_INVALID_STREAM)
+        return 0;
+    return ret < 0 ? -1 : 0;
+}
+
+
+/* Whether a command for this stream has to wait behind an earlier one. */
+static int cno_loop_cmd_waits(struct cno_loop_cmd_t *it, struct cno_loop_cmd_t *end, uint32_t stream)
+{
+    for (; it != end; it = it->next)
+        if (it->stream == stream)
+            return 1;
+    return 0;
+}
+
+
+/* Run the commands that were blocked, in order. Returns -1 if the connection should be closed. */
+static int cno_loop_cmd_retry(struct cno_loop_conn_t *c)
+{
+    for (struct cno_loop_cmd_t **it = &c->blocked; *it;) {
+        struct cno_loop_cmd_t *cmd = *it;
+        if (!cno_loop_cmd_waits(c->blocked, cmd, cmd->stream)) {
+            int ret = cno_loop_cmd_run(cmd);
+            if (ret < 0)
+                return CNO_ERROR_UP();
+            if (ret == 0) {
+                *it = cmd->next;
+                free(cmd);
+                continue;
+            }
+        }
+        it = &cmd->next;
+    }
+    return CNO_OK;
+}
+
+
+static void cno_loop_conn_fail(struct cno_loop_conn_t *);
+static void cno_loop_conn_unstall(struct cno_loop_conn_t *);
+
+
+/* Pass input to the connection. With posted writes, HTTP/1.x requests may be parsed
+   faster than they are responded to, in which case cno refuses to start the next one
+   (keeping it in the buffer) until the current response is complete. */
+static int cno_loop_feed(struct cno_loop_conn_t *c, const char *data, size_t size)
+{
+    if (cno_connection_data_received(&c->conn, data, size)) {
+        if (cno_error_code() != CNO_ERRNO_WOULD_BLOCK)
+            return CNO_ERROR_UP();
+        c->flags |= CNO_LOOP_STALLED;
+        return CNO_OK;
+    }
+    // a WINDOW_UPDATE may have unblocked some posted writes
+    return c->blocked ? cno_loop_cmd_retry(c) : CNO_OK;
+}
+
+
+static void cno_loop_run_posted(struct cno_loop_worker_t *w)
+{
+    uint64_t n;
+    while (read(w->wake, &n, sizeof(n)) < 0 && errno == EINTR) {}
+
+    struct cno_loop_cmd_t *cmd = __atomic_exchange_n(&w->posted, NULL, __ATOMIC_ACQUIRE), *fifo = NULL, *next;
+    for (; cmd; cmd = next) {
+        next = cmd->next;
+        cmd->next = fifo;
+        fifo = cmd;
+    }
+
+    for (cmd = fifo; cmd; cmd = next) {
+        next = cmd->next;
+        struct cno_loop_conn_t *c = cmd->conn;
+        if (cmd->type == CNO_LOOP_CMD_UNREF) {
+            c->flags |= CNO_LOOP_UNREF;
+            cno_loop_conn_try_release(c);
+            continue;
+        }
+        if (c->flags & (CNO_LOOP_CLOSING | CNO_LOOP_DRAIN)) {
+            free(cmd);
+            continue;
+        }
+
+        struct cno_loop_cmd_t **tail = &c->blocked;
+        if (cmd->type == CNO_LOOP_CMD_RESET) {
+            // nothing else will be sent on this stream
+            while (*tail)
+                if ((*tail)->stream == cmd->stream) {
+                    struct cno_loop_cmd_t *old = *tail;
+                    *tail = old->next;
+                    free(old);
+                } else {
+                    tail = &(*tail)->next;
+                }
+        } else {
+            while (*tail)
+                tail = &(*tail)->next;
+        }
+
+        int ret = cno_loop_cmd_waits(c->blocked, NULL, cmd->stream) ? 1 : cno_loop_cmd_run(cmd);
+        if (ret > 0) {
+            cmd->next = NULL;
+            *tail = cmd;
+        } else {
+            free(cmd);
+        }
+        // finishing a response may let the next pipelined one start
+        if (ret < 0 || (ret == 0 && c->blocked && cno_loop_cmd_retry(c))) {
+            cno_loop_conn_fail(c);
+            continue;
+        }
+        cno_loop_mark_dirty(c);
+        if (ret == 0 && (c->flags & CNO_LOOP_STALLED))
+            cno_loop_conn_unstall(c);
+    }
+
+    if (!w->loop->uring) {
+        while (w->dirty) {
+            struct cno_loop_conn_t *c = w->dirty;
+            w->dirty = c->next_dirty;
+            c->flags &= ~CNO_LOOP_DIRTY;
+            if (cno_loop_flush(c))
+                cno_loop_conn_close(c);
+        }
+    }
+}
+
+
+static void cno_loop_accept(struct cno_loop_worker_t *w)
+{
+    while (1) {
+        int fd = accept4(w->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;  // EAGAIN, or out of file descriptors; in the latter case, the backlog fills up.
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct cno_loop_conn_t *c = cno_loop_conn_new(w, fd);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+
+        struct epoll_event ev = { EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, { .ptr = c } };
+        if ((w->loop->on_accept && w->loop->on_accept(w->loop->cb_data, c))
+         || epoll_ctl(w->epoll, EPOLL_CTL_ADD, fd, &ev)
+         || cno_connection_made(&c->conn, CNO_HTTP1)
+         || cno_loop_flush(c))
+            cno_loop_conn_close(c);
+    }
+}
+
+
+/* Read until the socket is drained or too much output is waiting, sending the output
+   after each chunk of input. Returns -1 if the connection should be closed. */
+static int cno_loop_pump(struct cno_loop_worker_t *w, struct cno_loop_conn_t *c)
+{
+    size_t limit = cno_loop_output_limit(w->loop);
+    while ((c->flags & CNO_LOOP_READABLE) && !(c->flags & CNO_LOOP_STALLED) && c->output.size < limit) {
+        ssize_t n = read(c->fd, w->input, sizeof(w->input));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return CNO_ERROR(DISCONNECT, "read: %s", strerror(errno));
+            c->flags &= ~CNO_LOOP_READABLE;
+            break;
+        }
+        if (n == 0) {
+            cno_connection_lost(&c->conn);
+            cno_loop_flush(c);
+            return CNO_ERROR(DISCONNECT, "connection closed");
+        }
+        if (cno_loop_feed(c, w->input, n)) {
+            cno_loop_flush(c);  // may contain a GOAWAY
+            return CNO_ERROR_UP();
+        }
+        if (cno_loop_flush(c))
+            return CNO_ERROR_UP();
+        // a short read means the socket is empty; more data would trigger another event.
+        // a shutdown that has already been reported would not, though.
+        if ((size_t) n < sizeof(w->input) && !(c->flags & CNO_LOOP_HUP))
+            c->flags &= ~CNO_LOOP_READABLE;
+    }
+    return CNO_OK;
+}
+
+
+static void *cno_loop_worker_main(void *data)
+{
+    struct cno_loop_worker_t *w = data;
+    struct epoll_event events[CNO_LOOP_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(w->epoll, events, CNO_LOOP_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == w->loop)
+                goto stop;
+            if (events[i].data.ptr == w) {
+                cno_loop_accept(w);
+                continue;
+            }
+            if (events[i].data.ptr == &w->wake) {
+                cno_loop_run_posted(w);
+                continue;
+            }
+
+            struct cno_loop_conn_t *c = events[i].data.ptr;
+            if (c->flags & CNO_LOOP_CLOSING)
+                continue;  // waiting for other threads to drop their references
+            if (events[i].events & EPOLLERR) {
+                cno_loop_conn_close(c);
+                continue;
+            }
+            if (events[i].events & (EPOLLRDHUP | EPOLLHUP))
+                c->flags |= CNO_LOOP_HUP;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+                c->flags |= CNO_LOOP_READABLE;
+            // EPOLLOUT means there's room in the socket buffer, which may let us resume reading.
+            if (cno_loop_flush(c) || cno_loop_pump(w, c))
+                cno_loop_conn_close(c);
+        }
+    }
+
+stop:
+    cno_loop_worker_clear(w);
+    return NULL;
+}
+
+
+#if CNO_LOOP_URING
+/* The io_uring backend. Each worker has a ring with a multishot accept on the listener
+ * and a multishot recv on every connection, which picks buffers from a ring provided
+ * to the kernel; a buffer goes back as soon as `cno_connection_data_received` returns.
+ * Output is collected in `output` while the completions are processed, then moved to
+ * `sending` and submitted as one `send` per connection; all of them go to the kernel
+ * in the same `io_uring_enter` that waits for the next completions. No liburing: the
+ * few bits of it needed here are simple enough. */
+static int cno_loop_uring_enter(struct cno_loop_ring_t *r, unsigned wait)
+{
+    while (1) {
+        long n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0) {
+            r->queued -= n;
+            return CNO_OK;
+        }
+        // EBUSY/EAGAIN: the completion queue is full and has to be processed first.
+        if (errno == EBUSY || errno == EAGAIN)
+            return CNO_OK;
+        if (errno != EINTR)
+            return CNO_ERROR(TRANSPORT, "io_uring_enter: %s", strerror(errno));
+    }
+}
+
+
+static struct io_uring_sqe *cno_loop_uring_sqe(struct cno_loop_ring_t *r, int op, int fd, uint64_t user_data)
+{
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->entries) {
+        if (cno_loop_uring_enter(r, 0))
+            return NULL;
+        if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->entries)
+            return CNO_ERROR_NULL(TRANSPORT, "io_uring submission queue is full");
+    }
+    // the kernel only looks at the queue during `io_uring_enter`, so filling the entry
+    // after moving the tail is fine.
+    struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = op;
+    sqe->fd        = fd;
+    sqe->user_data = user_data;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    return sqe;
+}
+
+
+static void cno_loop_uring_buffer_return(struct cno_loop_ring_t *r, uint16_t id)
+{
+    struct io_uring_buf *b = &r->buffers->bufs[r->buffer_tail & (CNO_LOOP_URING_BUFFERS - 1)];
+    b->addr = (uintptr_t) (r->buffer_data + (size_t) id * CNO_LOOP_URING_BUFFER_SIZE);
+    b->len  = CNO_LOOP_URING_BUFFER_SIZE;
+    b->bid  = id;
+    __atomic_store_n(&r->buffers->tail, ++r->buffer_tail, __ATOMIC_RELEASE);
+}
+
+
+static int cno_loop_uring_recv(struct cno_loop_conn_t *c)
+{
+    struct io_uring_sqe *sqe = cno_loop_uring_sqe(&c->worker->ring, IORING_OP_RECV, c->fd, (uintptr_t) c | CNO_LOOP_OP_RECV);
+    if (!sqe)
+        return CNO_ERROR_UP();
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    c->flags |= CNO_LOOP_RECV;
+    c->pending++;
+    return CNO_OK;
+}
+
+
+static void cno_loop_uring_cancel(struct cno_loop_ring_t *r, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = cno_loop_uring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, CNO_LOOP_OP_CANCEL);
+    if (sqe)
+        sqe->addr = user_data;
+}
+
+
+static void cno_loop_uring_cancel_all(struct cno_loop_conn_t *c)
+{
+    struct io_uring_sqe *sqe = cno_loop_uring_sqe(&c->worker->ring, IORING_OP_ASYNC_CANCEL, c->fd, CNO_LOOP_OP_CANCEL);
+    if (sqe)
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+
+/* Stop reading from a connection and close it once everything has been sent. */
+static void cno_loop_uring_drain(struct cno_loop_conn_t *c)
+{
+    c->flags |= CNO_LOOP_DRAIN;
+    if (c->flags & CNO_LOOP_RECV)
+        cno_loop_uring_cancel(&c->worker->ring, (uintptr_t) c | CNO_LOOP_OP_RECV);
+    cno_loop_mark_dirty(c);
+}
+
+
+/* Submit the next chunk of output unless a send is already in flight. Returns -1
+   if the connection should be closed. */
+static int cno_loop_uring_send(struct cno_loop_conn_t *c)
+{
+    if (c->flags & (CNO_LOOP_SEND | CNO_LOOP_CLOSING))
+        return CNO_OK;
+    if (!c->sending.size) {
+        struct cno_buffer_dyn_t tmp = c->sending;
+        c->sending = c->output;
+        c->output = tmp;
+    }
+    if (!c->sending.size)
+        return c->flags & CNO_LOOP_DRAIN ? CNO_ERROR(DISCONNECT, "connection closed") : CNO_OK;
+
+    struct io_uring_sqe *sqe = cno_loop_uring_sqe(&c->worker->ring, IORING_OP_SEND, c->fd, (uintptr_t) c | CNO_LOOP_OP_SEND);
+    if (!sqe)
+        return CNO_ERROR_UP();
+    sqe->addr      = (uintptr_t) c->sending.data;
+    sqe->len       = c->sending.size > UINT32_MAX ? UINT32_MAX : c->sending.size;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    c->flags |= CNO_LOOP_SEND;
+    c->pending++;
+    return CNO_OK;
+}
+
+
+static void cno_loop_uring_accept_arm(struct cno_loop_worker_t *w)
+{
+    struct io_uring_sqe *sqe = cno_loop_uring_sqe(&w->ring, IORING_OP_ACCEPT, w->listener, (uintptr_t) w | CNO_LOOP_OP_ACCEPT);
+    if (sqe) {
+        sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+}
+
+
+static void cno_loop_uring_wake_arm(struct cno_loop_worker_t *w)
+{
+    struct io_uring_sqe *sqe = cno_loop_uring_sqe(&w->ring, IORING_OP_POLL_ADD, w->wake, (uintptr_t) w | CNO_LOOP_OP_WAKE);
+    if (sqe) {
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+    }
+}
+
+
+static void cno_loop_uring_on_accept(struct cno_loop_worker_t *w, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !w->stopping)
+        cno_loop_uring_accept_arm(w);
+    if (cqe->res < 0)
+        return;  // same as with epoll: if out of file descriptors, the backlog fills up.
+    if (w->stopping) {
+        close(cqe->res);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(cqe->res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct cno_loop_conn_t *c = cno_loop_conn_new(w, cqe->res);
+    if (!c) {
+        close(cqe->res);
+        return;
+    }
+    if ((w->loop->on_accept && w->loop->on_accept(w->loop->cb_data, c))
+     || cno_connection_made(&c->conn, CNO_HTTP1)
+     || cno_loop_uring_recv(c))
+        cno_loop_conn_close(c);
+}
+
+
+static void cno_loop_uring_on_recv(struct cno_loop_worker_t *w, struct cno_loop_conn_t *c, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->flags &= ~CNO_LOOP_RECV;
+        c->pending--;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        int stopped = c->flags & (CNO_LOOP_PAUSED | CNO_LOOP_STALLED);
+        int err = !(c->flags & (CNO_LOOP_CLOSING | CNO_LOOP_DRAIN))
+               && cno_loop_feed(c, w->ring.buffer_data + (size_t) id * CNO_LOOP_URING_BUFFER_SIZE, cqe->res);
+        cno_loop_uring_buffer_return(&w->ring, id);
+        if (err) {
+            cno_loop_uring_drain(c);  // the output may contain a GOAWAY
+        } else if (!(c->flags & CNO_LOOP_CLOSING)) {
+            if (c->output.size + c->sending.size >= cno_loop_output_limit(w->loop))
+                c->flags |= CNO_LOOP_PAUSED;
+            if (!stopped && (c->flags & (CNO_LOOP_PAUSED | CNO_LOOP_STALLED)) && (c->flags & CNO_LOOP_RECV))
+                cno_loop_uring_cancel(&w->ring, (uintptr_t) c | CNO_LOOP_OP_RECV);
+        }
+    } else if (cqe->res == 0) {
+        if (!(c->flags & CNO_LOOP_CLOSING))
+            cno_connection_lost(&c->conn);
+        cno_loop_uring_drain(c);
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        cno_loop_conn_close(c);
+    }
+
+    if (c->flags & CNO_LOOP_CLOSING) {
+        cno_loop_conn_try_release(c);
+    } else if (!(c->flags & (CNO_LOOP_RECV | CNO_LOOP_PAUSED | CNO_LOOP_STALLED | CNO_LOOP_DRAIN))) {
+        // -ENOBUFS: all buffers were in use; some have been returned by now.
+        if (cno_loop_uring_recv(c))
+            cno_loop_conn_close(c);
+    }
+}
+
+
+static void cno_loop_uring_on_send(struct cno_loop_worker_t *w, struct cno_loop_conn_t *c, struct io_uring_cqe *cqe)
+{
+    c->flags &= ~CNO_LOOP_SEND;
+    c->pending--;
+    if (c->flags & CNO_LOOP_CLOSING) {
+        cno_loop_conn_try_release(c);
+        return;
+    }
+    if (cqe->res < 0) {
+        cno_loop_conn_close(c);
+        return;
+    }
+
+    cno_buffer_dyn_shift(&c->sending, cqe->res);
+    if ((c->flags & CNO_LOOP_PAUSED) && c->output.size + c->sending.size < cno_loop_output_limit(w->loop)) {
+        c->flags &= ~CNO_LOOP_PAUSED;
+        if (!(c->flags & (CNO_LOOP_RECV | CNO_LOOP_STALLED | CNO_LOOP_DRAIN)) && cno_loop_uring_recv(c)) {
+            cno_loop_conn_close(c);
+            return;
+        }
+    }
+    if (cno_loop_uring_send(c))
+        cno_loop_conn_close(c);
+}
+
+
+static void cno_loop_uring_complete(struct cno_loop_worker_t *w, struct io_uring_cqe *cqe)
+{
+    void *ptr = (void *) (uintptr_t) (cqe->user_data & ~(uint64_t) CNO_LOOP_OP_MASK);
+    switch (cqe->user_data & CNO_LOOP_OP_MASK) {
+        case CNO_LOOP_OP_RECV:   cno_loop_uring_on_recv(w, ptr, cqe); break;
+        case CNO_LOOP_OP_SEND:   cno_loop_uring_on_send(w, ptr, cqe); break;
+        case CNO_LOOP_OP_ACCEPT: cno_loop_uring_on_accept(w, cqe); break;
+        case CNO_LOOP_OP_WAKE:
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                cno_loop_uring_wake_arm(w);
+            cno_loop_run_posted(w);
+            break;
+        case CNO_LOOP_OP_STOP:
+            // the worker exits once the kernel is done with every connection, which for
+            // some means waiting for their operations to be cancelled.
+            w->stopping = 1;
+            cno_loop_uring_cancel(&w->ring, (uintptr_t) w | CNO_LOOP_OP_ACCEPT);
+            for (struct cno_loop_conn_t *c = w->open.first, *next; c != cno_list_end(&w->open); c = next) {
+                next = c->next;
+                cno_loop_conn_close(c);
+            }
+            break;
+    }
+}
+
+
+static int cno_loop_uring_busy(struct cno_loop_worker_t *w)
+{
+    for (struct cno_loop_conn_t *c = w->open.first; c != cno_list_end(&w->open); c = c->next)
+        if (c->pending)
+            return 1;
+    return 0;
+}
+
+
+static void *cno_loop_uring_main(void *data)
+{
+    struct cno_loop_worker_t *w = data;
+    struct cno_loop_ring_t *r = &w->ring;
+    // with IORING_SETUP_SINGLE_ISSUER, this makes this thread the only one allowed to submit.
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0)
+        return NULL;
+
+    struct io_uring_sqe *sqe = cno_loop_uring_sqe(r, IORING_OP_POLL_ADD, w->loop->stop_fd, (uintptr_t) w | CNO_LOOP_OP_STOP);
+    if (!sqe)
+        return NULL;
+    sqe->poll32_events = POLLIN;
+    cno_loop_uring_accept_arm(w);
+    cno_loop_uring_wake_arm(w);
+
+    while (!w->stopping || cno_loop_uring_busy(w)) {
+        while (w->dirty) {
+            struct cno_loop_conn_t *c = w->dirty;
+            w->dirty = c->next_dirty;
+            c->flags &= ~CNO_LOOP_DIRTY;
+            if (cno_loop_uring_send(c))
+                cno_loop_conn_close(c);
+        }
+        if (cno_loop_uring_enter(r, 1))
+            break;
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+            cno_loop_uring_complete(w, &cqe);
+        }
+    }
+
+    cno_loop_worker_clear(w);
+    return NULL;
+}
+
+
+static int cno_loop_uring_init(struct cno_loop_ring_t *r)
+{
+    // R_DISABLED delays picking the submitter thread for SINGLE_ISSUER until the worker
+    // enables the ring. SINGLE_ISSUER and DEFER_TASKRUN need Linux 6.1; without them,
+    // completions are posted from interrupts, which is a bit slower but works on 6.0.
+    struct io_uring_params p;
+    unsigned flags[] = {
+        IORING_SETUP_R_DISABLED | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_R_DISABLED | IORING_SETUP_SUBMIT_ALL,
+    };
+    for (size_t i = 0; i < sizeof(flags) / sizeof(*flags); i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = flags[i] | IORING_SETUP_CQSIZE;
+        p.cq_entries = CNO_LOOP_URING_ENTRIES * 4;  // each multishot recv may post many
+        if ((r->fd = syscall(__NR_io_uring_setup, CNO_LOOP_URING_ENTRIES, &p)) >= 0 || errno != EINVAL)
+            break;
+    }
+    if (r->fd < 0)
+        return CNO_ERROR(TRANSPORT, "io_uring_setup: %s", strerror(errno));
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        return CNO_ERROR(NOT_IMPLEMENTED, "io_uring is too old");
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->map_size = sq_size > cq_size ? sq_size : cq_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->map == MAP_FAILED)
+        return r->map = NULL, CNO_ERROR(TRANSPORT, "mmap: %s", strerror(errno));
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        return r->sqes = NULL, CNO_ERROR(TRANSPORT, "mmap: %s", strerror(errno));
+
+    char *base = r->map;
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned *) (base + p.sq_off.head);
+    r->sq_tail = (unsigned *) (base + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (base + p.sq_off.ring_mask);
+    r->cq_head = (unsigned *) (base + p.cq_off.head);
+    r->cq_tail = (unsigned *) (base + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (base + p.cq_off.ring_mask);
+    r->cqes    = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+    // SQE slots are always used in order, so the indirection array is the identity.
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        ((unsigned *) (base + p.sq_off.array))[i] = i;
+
+    r->buffers = mmap(NULL, CNO_LOOP_URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->buffers == MAP_FAILED)
+        return r->buffers = NULL, CNO_ERROR(NO_MEMORY, "%zu bytes", CNO_LOOP_URING_BUFFERS * sizeof(struct io_uring_buf));
+    if (!(r->buffer_data = malloc((size_t) CNO_LOOP_URING_BUFFERS * CNO_LOOP_URING_BUFFER_SIZE)))
+        return CNO_ERROR(NO_MEMORY, "%zu bytes", (size_t) CNO_LOOP_URING_BUFFERS * CNO_LOOP_URING_BUFFER_SIZE);
+    struct io_uring_buf_reg reg = { .ring_addr = (uintptr_t) r->buffers, .ring_entries = CNO_LOOP_URING_BUFFERS, .bgid = 0 };
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return CNO_ERROR(TRANSPORT, "io_uring_register: %s", strerror(errno));
+    for (unsigned i = 0; i < CNO_LOOP_URING_BUFFERS; i++)
+        cno_loop_uring_buffer_return(r, i);
+    return CNO_OK;
+}
+
+
+static void cno_loop_uring_clear(struct cno_loop_ring_t *r)
+{
+    if (r->fd >= 0)
+        close(r->fd);
+    if (r->map)
+        munmap(r->map, r->map_size);
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->buffers)
+        munmap(r->buffers, CNO_LOOP_URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(r->buffer_data);
+}
+#endif
+
+
+static void cno_loop_conn_fail(struct cno_loop_conn_t *c)
+{
+#if CNO_LOOP_URING
+    if (c->worker->loop->uring) {
+        cno_loop_uring_drain(c);
+        return;
+    }
+#endif
+    cno_loop_flush(c);  // may contain a GOAWAY
+    cno_loop_conn_close(c);
+}
+
+
+/* Retry the input held back by `cno_loop_feed`, then continue reading. */
+static void cno_loop_conn_unstall(struct cno_loop_conn_t *c)
+{
+    c->flags &= ~CNO_LOOP_STALLED;
+    if (cno_loop_feed(c, NULL, 0)) {
+        cno_loop_conn_fail(c);
+        return;
+    }
+    if (c->flags & CNO_LOOP_STALLED)
+        return;
+#if CNO_LOOP_URING
+    if (c->worker->loop->uring) {
+        if (!(c->flags & (CNO_LOOP_RECV | CNO_LOOP_PAUSED | CNO_LOOP_DRAIN)) && cno_loop_uring_recv(c))
+            cno_loop_conn_close(c);
+        return;
+    }
+#endif
+    // the socket may have become readable in the meantime; there was an event for that.
+    c->flags |= CNO_LOOP_READABLE;
+    if (cno_loop_pump(c->worker, c))
+        cno_loop_conn_close(c);
+}
+
+
+static int cno_loop_listen(struct cno_loop_t *loop, struct cno_loop_worker_t *w)
+{
+    char port[8];
+    snprintf(port, sizeof(port), "%u", loop->port);
+    struct addrinfo *ai = NULL;
+    struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int err = getaddrinfo(loop->host, port, &hints, &ai);
+    if (err)
+        return CNO_ERROR(TRANSPORT, "getaddrinfo: %s", gai_strerror(err));
+
+    int one = 1;
+    w->listener = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (w->listener < 0
+     || setsockopt(w->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+     || setsockopt(w->listener, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))
+     || bind(w->listener, ai->ai_addr, ai->ai_addrlen)
+     || listen(w->listener, SOMAXCONN)) {
+        freeaddrinfo(ai);
+        return CNO_ERROR(TRANSPORT, "listen: %s", strerror(errno));
+    }
+    freeaddrinfo(ai);
+
+    if ((w->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return CNO_ERROR(TRANSPORT, "eventfd: %s", strerror(errno));
+#if CNO_LOOP_URING
+    if (loop->uring)
+        return cno_loop_uring_init(&w->ring);
+#endif
+    struct epoll_event accept_ev = { EPOLLIN | EPOLLET, { .ptr = w } };
+    struct epoll_event wake_ev = { EPOLLIN, { .ptr = &w->wake } };
+    // level-triggered and never read, so that every worker sees it.
+    struct epoll_event stop_ev = { EPOLLIN, { .ptr = loop } };
+    if ((w->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0
+     || epoll_ctl(w->epoll, EPOLL_CTL_ADD, w->listener, &accept_ev)
+     || epoll_ctl(w->epoll, EPOLL_CTL_ADD, w->wake, &wake_ev)
+     || epoll_ctl(w->epoll, EPOLL_CTL_ADD, loop->stop_fd, &stop_ev))
+        return CNO_ERROR(TRANSPORT, "epoll: %s", strerror(errno));
+    return CNO_OK;
+}
+
+
+int cno_loop_start(struct cno_loop_t *loop)
+{
+#if !CNO_LOOP_URING
+    if (loop->uring)
+        return CNO_ERROR(NOT_IMPLEMENTED, "built without <linux/io_uring.h>");
+#endif
+    unsigned threads = loop->threads;
+    if (!threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    if (!(loop->workers = calloc(threads, sizeof(struct cno_loop_worker_t))))
+        return CNO_ERROR(NO_MEMORY, "%zu bytes", threads * sizeof(struct cno_loop_worker_t));
+    loop->running = 0;
+    if ((loop->stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        free(loop->workers);
+        return CNO_ERROR(TRANSPORT, "eventfd: %s", strerror(errno));
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        struct cno_loop_worker_t *w = &loop->workers[i];
+        w->loop = loop;
+        w->epoll = w->listener = w->wake = -1;
+#if CNO_LOOP_URING
+        w->ring.fd = -1;
+#endif
+        cno_list_init(&w->open);
+        cno_list_init(&w->pool);
+        loop->running++;
+        if (cno_loop_listen(loop, w)) {
+            cno_loop_stop(loop);
+            return CNO_ERROR_UP();
+        }
+#if CNO_LOOP_URING
+        int err = pthread_create(&w->thread, NULL, loop->uring ? &cno_loop_uring_main : &cno_loop_worker_main, w);
+#else
+        int err = pthread_create(&w->thread, NULL, &cno_loop_worker_main, w);
+#endif
+        if (err) {
+            cno_loop_stop(loop);
+            return CNO_ERROR(TRANSPORT, "pthread_create: %s", strerror(err));
+        }
+        w->started = 1;
+    }
+    return CNO_OK;
+}
+
+
+void cno_loop_stop(struct cno_loop_t *loop)
+{
+    if (!loop->workers)
+        return;
+    uint64_t one = 1;
+    while (write(loop->stop_fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+
+    for (unsigned i = 0; i < loop->running; i++) {
+        struct cno_loop_worker_t *w = &loop->workers[i];
+        if (w->started)
+            pthread_join(w->thread, NULL);
+        if (w->listener >= 0)
+            close(w->listener);
+        if (w->epoll >= 0)
+            close(w->epoll);
+        if (w->wake >= 0)
+            close(w->wake);
+#if CNO_LOOP_URING
+        cno_loop_uring_clear(&w->ring);
+#endif
+    }
+
+    close(loop->stop_fd);
+    free(loop->workers);
+    loop->workers = NULL;
+    loop->running = 0;
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include "core.h"
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct cno_loop_cmd_t;
+
+
+/* An optional I/O driver for Linux: accepts TCP connections and runs a server-side
+ * `cno_connection_t` for each, spread over a number of worker threads. Not part of
+ * libcno.a; link obj/loop.o and `-pthread` to use it.
+ *
+ * Each worker has its own listening socket (SO_REUSEPORT, so the kernel balances new
+ * connections between them), its own edge-triggered epoll instance, a read buffer
+ * shared by all its connections, and a pool of connection objects to reuse. A connection
+ * never moves between threads, so callbacks for it are always run on the same one.
+ * Whatever cno writes is buffered until the input read so far has been processed;
+ * writes of at least CNO_LOOP_WRITE_DIRECT bytes are sent right away together with
+ * the buffer by a single `sendmsg`, without copying.
+ *
+ * With `uring` set, the workers use io_uring (Linux 6.0+, 6.1+ for best results) instead:
+ * a multishot accept, a multishot recv per connection that reads into a ring of buffers
+ * shared by the worker's connections, and one `send` per connection for everything
+ * written while processing a batch of completions, all submitted by the single syscall
+ * that also waits for the next batch. Writes are always copied in this mode. */
+struct cno_loop_conn_t
+{
+    struct cno_list_link_t(struct cno_loop_conn_t);  // in the worker's list of open or pooled connections
+    /* `conn.cb_data` points to this struct, and `conn.on_write` is taken; set the rest
+       of the callbacks in `on_accept`. */
+    struct cno_connection_t conn;
+    struct cno_loop_worker_t *worker;
+    struct cno_buffer_dyn_t output;  // not yet accepted by the kernel
+    struct cno_buffer_dyn_t sending;  // io_uring only: passed to a `send` that has not completed yet
+    struct cno_loop_conn_t *next_dirty;  // io_uring only: has output to submit at the end of the iteration
+    struct cno_loop_cmd_t *blocked;  // posted writes waiting for flow control, oldest first
+    struct cno_loop_cmd_t *unref;  // posted by the last `cno_loop_conn_unref`
+    void *data;  // for the application
+    int fd;
+    int flags;
+    unsigned pending;  // io_uring only: operations the kernel has not completed yet
+    unsigned refs;  // see `cno_loop_conn_ref`
+};
+
+
+struct cno_loop_t
+{
+    /* Set these before `cno_loop_start`. */
+    const char *host;  // NULL = all interfaces
+    uint16_t port;
+    unsigned threads;  // 0 = one per online CPU
+    size_t output_limit;  // stop reading a connection while it has this much unsent; 0 = 1 MiB
+    int uring;  // use io_uring instead of epoll; `cno_loop_start` fails if not compiled in
+    void *cb_data;
+    /* Called on the worker thread after `cno_connection_init` and before `cno_connection_made`
+       (in HTTP/1.x mode; h2c with prior knowledge is detected by the preface). Return -1
+       with an error set to refuse the connection. */
+    int  (*on_accept)(void *, struct cno_loop_conn_t *);
+    /* Called on the worker thread before the connection is reset and recycled, including
+       connections that are still open when the loop is stopped. Optional. */
+    void (*on_close )(void *, struct cno_loop_conn_t *);
+
+    /* Private. */
+    struct cno_loop_worker_t *workers;
+    unsigned running;
+    int stop_fd;
+};
+
+
+/* Bind, listen, and start the worker threads. Returns as soon as they are running. */
+int  cno_loop_start (struct cno_loop_t *);
+/* Close all connections, join the threads, free everything. Can be called from any
+   thread except a worker; once it returns, the loop can be started again. */
+void cno_loop_stop  (struct cno_loop_t *);
+/* Send what has been buffered so far. Only needed after writing to a connection outside
+   of its callbacks (on the same thread!); everything else is flushed automatically. */
+int  cno_loop_flush (struct cno_loop_conn_t *);
+
+/* Writing from other threads.
+ *
+ * A connection can only be used on its worker thread, but a response may be prepared
+ * elsewhere. The functions below copy a write into a command and push it onto a lock-free
+ * queue of the connection's worker; the worker is woken up if the queue was empty, and
+ * runs everything it finds in order, then flushes each connection once. The only locking
+ * is a compare-and-swap on the queue head.
+ *
+ * Posted data is sent as flow control allows: what does not fit into the window waits
+ * until the peer opens it, and later writes on the same stream wait behind it. Writes
+ * that `cno_write_message` refuses with WOULD_BLOCK (e.g. an HTTP/1.1 response to a
+ * pipelined request that must come after one still being prepared) wait as well. Writes
+ * to streams that have been reset in the meantime, and to closed connections, are dropped.
+ * Any other error closes the connection, same as an error returned from a callback.
+ *
+ * To keep the connection object itself valid, take a reference on its thread (e.g. in
+ * `on_message_end`) before passing it elsewhere, and drop it on any thread when done.
+ * A connection that is closed while referenced is only recycled after the last
+ * `cno_loop_conn_unref`. All references must be dropped before `cno_loop_stop`. */
+void cno_loop_conn_ref     (struct cno_loop_conn_t *);
+void cno_loop_conn_unref   (struct cno_loop_conn_t *);
+/* Same as `cno_write_message`, `cno_write_data`, and `cno_write_reset`, but thread-safe
+   and asynchronous. Only fail if out of memory. The template of the message, if any,
+   must remain valid until the message is sent; the rest is copied. */
+int  cno_loop_post_message (struct cno_loop_conn_t *, uint32_t stream, const struct cno_message_t *, int final);
+int  cno_loop_post_data    (struct cno_loop_conn_t *, uint32_t stream, const char *, size_t, int final);
+int  cno_loop_post_reset   (struct cno_loop_conn_t *, uint32_t stream, enum CNO_RST_STREAM_CODE);
+
+#if __cplusplus
+}
+#endif
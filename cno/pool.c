@@ -0,0 +1,356 @@
+#include "pool.h"
+
+
+enum CNO_POOL_CONN_STATE
+{
+    CNO_POOL_CONNECTING,
+    CNO_POOL_READY,
+    CNO_POOL_CLOSED,
+};
+
+
+enum CNO_POOL_REQUEST_FLAGS
+{
+    CNO_POOL_RESPONDED = 0x01,  // got a final (non-1xx) response head
+    CNO_POOL_COMPLETE  = 0x02,  // ...and the whole response
+    CNO_POOL_REFUSED   = 0x04,  // reset with REFUSED_STREAM
+};
+
+
+static struct cno_pool_request_t * cno_pool_find(const struct cno_pool_conn_t *c, uint32_t stream)
+{
+    struct cno_pool_request_t *r = c->requests;
+    while (r && r->stream != stream) r = r->next;
+    return r;
+}
+
+
+static void cno_pool_unlink(struct cno_pool_request_t **list, struct cno_pool_request_t *r)
+{
+    while (*list != r) list = &(*list)->next;
+    *list = r->next;
+}
+
+
+static void cno_pool_close_request(struct cno_pool_request_t *r, int complete)
+{
+    r->conn = NULL;
+    r->stream = 0;
+    r->on_close(r->data, complete);
+}
+
+
+static void cno_pool_fail_queue(struct cno_pool_t *pool)
+{
+    for (struct cno_pool_request_t *r; (r = pool->queue);) {
+        pool->queue = r->next;
+        cno_pool_close_request(r, 0);
+    }
+    pool->queue_last = NULL;
+}
+
+
+static int cno_pool_is_usable(const struct cno_pool_conn_t *c)
+{
+    return c->state == CNO_POOL_READY && c->conn.goaway_recv == (uint32_t) -1;
+}
+
+
+/* RFC 7231 section 4.2.1; safe requests with no payload can be sent again as they are. */
+static int cno_pool_is_retryable(const struct cno_pool_request_t *r)
+{
+    return r->final && (cno_buffer_eq(r->msg->method, CNO_BUFFER_STRING("GET"))
+                     || cno_buffer_eq(r->msg->method, CNO_BUFFER_STRING("HEAD"))
+                     || cno_buffer_eq(r->msg->method, CNO_BUFFER_STRING("OPTIONS")));
+}
+
+
+static int cno_pool_on_write(void *data, const char *buf, size_t size)
+{
+    struct cno_pool_conn_t *c = data;
+    return c->pool->on_write(c->pool->cb_data, c, buf, size);
+}
+
+
+static int cno_pool_on_message_start(void *data, uint32_t stream, const struct cno_message_t *msg)
+{
+    struct cno_pool_request_t *r = cno_pool_find(data, stream);
+    if (!r || msg->code < 200)
+        return CNO_OK;
+    r->flags |= CNO_POOL_RESPONDED;
+    return r->on_response(r->data, msg);
+}
+
+
+static int cno_pool_on_message_data(void *data, uint32_t stream, const char *buf, size_t size)
+{
+    struct cno_pool_request_t *r = cno_pool_find(data, stream);
+    return r ? r->on_data(r->data, buf, size) : CNO_OK;
+}
+
+
+static int cno_pool_on_message_end(void *data, uint32_t stream)
+{
+    struct cno_pool_request_t *r = cno_pool_find(data, stream);
+    if (r)
+        r->flags |= CNO_POOL_COMPLETE;
+    return CNO_OK;
+}
+
+
+static int cno_pool_on_flow_increase(void *data, uint32_t stream)
+{
+    struct cno_pool_conn_t *c = data;
+    // a request that completes as a result may be freed, but not the next one.
+    for (struct cno_pool_request_t *r = c->requests, *next; r; r = next) {
+        next = r->next;
+        if ((!stream || r->stream == stream) && r->on_flow_increase && r->on_flow_increase(r->data, r))
+            return CNO_ERROR_UP();
+    }
+    return CNO_OK;
+}
+
+
+static int cno_pool_on_stream_reset(void *data, uint32_t stream, uint32_t code)
+{
+    struct cno_pool_request_t *r = cno_pool_find(data, stream);
+    if (r && code == CNO_RST_REFUSED_STREAM)
+        r->flags |= CNO_POOL_REFUSED;
+    return CNO_OK;
+}
+
+
+static void cno_pool_dispatch(struct cno_pool_t *);
+
+
+static int cno_pool_on_settings(void *data)
+{
+    // until the first SETTINGS, the limit on concurrent streams is unknown; sending
+    // too many may get the whole connection closed.
+    struct cno_pool_conn_t *c = data;
+    if (c->state == CNO_POOL_CONNECTING)
+        c->state = CNO_POOL_READY;
+    cno_pool_dispatch(c->pool);
+    return CNO_OK;
+}
+
+
+static int cno_pool_on_stream_end(void *data, uint32_t stream)
+{
+    struct cno_pool_conn_t *c = data;
+    struct cno_pool_request_t *r = cno_pool_find(c, stream);
+    if (!r)
+        return CNO_OK;
+
+    cno_pool_unlink(&c->requests, r);
+    if (!(r->flags & CNO_POOL_RESPONDED) && ((r->flags & CNO_POOL_REFUSED) || stream > c->conn.goaway_recv)
+     && cno_pool_is_retryable(r)) {
+        // the server did not process it, so it can go to another connection.
+        struct cno_pool_t *pool = c->pool;
+        r->conn = NULL;
+        r->stream = 0;
+        if (!(r->next = pool->queue))
+            pool->queue_last = r;
+        pool->queue = r;
+    } else
+        cno_pool_close_request(r, !!(r->flags & CNO_POOL_COMPLETE));
+
+    // when closing, `cno_pool_conn_close`'s caller dispatches the queue.
+    if (c->state != CNO_POOL_CLOSED)
+        cno_pool_dispatch(c->pool);
+    return CNO_OK;
+}
+
+
+/* Write the head on a new stream. If that fails, so does the request. */
+static void cno_pool_send(struct cno_pool_conn_t *c, struct cno_pool_request_t *r)
+{
+    // linked first so that the events for the stream can find it.
+    r->conn = c;
+    r->stream = cno_connection_next_stream(&c->conn);
+    r->flags = 0;
+    r->next = c->requests;
+    c->requests = r;
+
+    if (cno_write_message(&c->conn, r->stream, r->msg, r->final)) {
+        cno_pool_unlink(&c->requests, r);
+        cno_pool_close_request(r, 0);
+    } else if (r->on_sent && r->on_sent(r->data, r))
+        cno_pool_cancel(c->pool, r);
+}
+
+
+static int cno_pool_open(struct cno_pool_t *pool)
+{
+    struct cno_pool_conn_t *c = malloc(sizeof(struct cno_pool_conn_t));
+    if (!c)
+        return CNO_ERROR(NO_MEMORY, "%zu bytes", sizeof(struct cno_pool_conn_t));
+
+    *c = (struct cno_pool_conn_t) { .next = pool->conns, .pool = pool, .state = CNO_POOL_CONNECTING };
+    cno_connection_init(&c->conn, CNO_CLIENT);
+    c->conn.cb_data          = c;
+    c->conn.on_write         = &cno_pool_on_write;
+    c->conn.on_stream_end    = &cno_pool_on_stream_end;
+    c->conn.on_stream_reset  = &cno_pool_on_stream_reset;
+    c->conn.on_flow_increase = &cno_pool_on_flow_increase;
+    c->conn.on_message_start = &cno_pool_on_message_start;
+    c->conn.on_message_data  = &cno_pool_on_message_data;
+    c->conn.on_message_end   = &cno_pool_on_message_end;
+    c->conn.on_settings      = &cno_pool_on_settings;
+    c->conn.settings[CNO_LOCAL].enable_push = 0;
+    pool->conns = c;
+
+    if (pool->on_connect(pool->cb_data, c)) {
+        pool->conns = c->next;
+        cno_connection_reset(&c->conn);
+        free(c);
+        return CNO_ERROR_UP();
+    }
+    return CNO_OK;
+}
+
+
+static void cno_pool_dispatch(struct cno_pool_t *pool)
+{
+    while (pool->queue) {
+        struct cno_pool_conn_t *best = NULL;
+        unsigned count = 0;
+        int connecting = 0;
+        for (struct cno_pool_conn_t *c = pool->conns; c; c = c->next) {
+            if (c->state == CNO_POOL_CONNECTING)
+                connecting = 1;
+            if (c->state == CNO_POOL_CONNECTING || cno_pool_is_usable(c))
+                count++;
+            if (!cno_pool_is_usable(c))
+                continue;
+            uint32_t used = c->conn.stream_count[CNO_LOCAL];
+            if (used < c->conn.settings[CNO_REMOTE].max_concurrent_streams
+             && (!best || used < best->conn.stream_count[CNO_LOCAL]))
+                best = c;
+        }
+
+        if (!best) {
+            // one new connection at a time, as it may allow a lot of streams.
+            if (!connecting && count < (pool->max_connections ? pool->max_connections : 1)
+             && cno_pool_open(pool) && !count)
+                cno_pool_fail_queue(pool);
+            return;
+        }
+
+        struct cno_pool_request_t *r = pool->queue;
+        if (!(pool->queue = r->next))
+            pool->queue_last = NULL;
+        cno_pool_send(best, r);
+    }
+}
+
+
+/* Fail or requeue the requests, then free the connection. Does not dispatch the queue. */
+static void cno_pool_conn_close(struct cno_pool_conn_t *c)
+{
+    struct cno_pool_t *pool = c->pool;
+    c->state = CNO_POOL_CLOSED;
+    // fires `on_stream_end` for every open stream; if a callback fails, it stops early.
+    cno_connection_lost(&c->conn);
+    while (c->requests) {
+        struct cno_pool_request_t *r = c->requests;
+        c->requests = r->next;
+        cno_pool_close_request(r, 0);
+    }
+    cno_connection_reset(&c->conn);
+
+    struct cno_pool_conn_t **it = &pool->conns;
+    while (*it != c) it = &(*it)->next;
+    *it = c->next;
+    pool->on_close(pool->cb_data, c);
+    free(c);
+}
+
+
+void cno_pool_clear(struct cno_pool_t *pool)
+{
+    while (pool->conns)
+        cno_pool_conn_close(pool->conns);
+    cno_pool_fail_queue(pool);
+}
+
+
+int cno_pool_request(struct cno_pool_t *pool, struct cno_pool_request_t *r)
+{
+    if (!r->msg || !r->on_response || !r->on_data || !r->on_close)
+        return CNO_ERROR(ASSERTION, "request has no message or callbacks");
+
+    *(pool->queue ? &pool->queue_last->next : &pool->queue) = r;
+    pool->queue_last = r;
+    r->next = NULL;
+    r->conn = NULL;
+    r->stream = 0;
+    cno_pool_dispatch(pool);
+    return CNO_OK;
+}
+
+
+int cno_pool_cancel(struct cno_pool_t *pool, struct cno_pool_request_t *r)
+{
+    if (!r->conn) {
+        struct cno_pool_request_t *prev = NULL, *it = pool->queue;
+        for (; it && it != r; prev = it, it = it->next) {}
+        if (!it)
+            return CNO_ERROR(ASSERTION, "request is not in this pool");
+        *(prev ? &prev->next : &pool->queue) = r->next;
+        if (pool->queue_last == r)
+            pool->queue_last = prev;
+        cno_pool_close_request(r, 0);
+        return CNO_OK;
+    }
+
+    struct cno_pool_conn_t *c = r->conn;
+    int ret = cno_write_reset(&c->conn, r->stream, CNO_RST_CANCEL);
+    // until the response head arrives, the stream is kept open to decode it; forget
+    // about the request right away instead of waiting for `on_stream_end`.
+    if (cno_pool_find(c, r->stream) == r) {
+        cno_pool_unlink(&c->requests, r);
+        cno_pool_close_request(r, 0);
+    }
+    return ret;
+}
+
+
+int cno_pool_connected(struct cno_pool_conn_t *c)
+{
+    // requests are sent once the server's SETTINGS arrive.
+    if (cno_connection_made(&c->conn, CNO_HTTP2)) {
+        cno_pool_lost(c);
+        return CNO_ERROR_UP();
+    }
+    return CNO_OK;
+}
+
+
+int cno_pool_data_received(struct cno_pool_conn_t *c, const char *data, size_t size)
+{
+    if (!cno_connection_data_received(&c->conn, data, size))
+        return CNO_OK;
+
+    // after a GOAWAY, this means that all accepted streams are done.
+    int drained = cno_error_code() == CNO_ERRNO_DISCONNECT && c->conn.goaway_recv != (uint32_t) -1;
+    cno_pool_lost(c);
+    return drained ? CNO_OK : CNO_ERROR_UP();
+}
+
+
+void cno_pool_lost(struct cno_pool_conn_t *c)
+{
+    struct cno_pool_t *pool = c->pool;
+    int connecting = c->state == CNO_POOL_CONNECTING;
+    cno_pool_conn_close(c);
+
+    if (connecting) {
+        int usable = 0;
+        for (struct cno_pool_conn_t *it = pool->conns; it; it = it->next)
+            usable |= cno_pool_is_usable(it);
+        if (!usable)
+            cno_pool_fail_queue(pool);
+    }
+    cno_pool_dispatch(pool);
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include "core.h"
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct cno_pool_t;
+
+
+/* A request to be sent through a pool. Fill in the first part, then `cno_pool_request`. */
+struct cno_pool_request_t
+{
+    /* Must remain valid until `on_close`, as the request may be sent more than once. */
+    const struct cno_message_t *msg;
+    int final;  // there is no payload
+    void *data;  // passed as the first argument to the callbacks
+    /* Called once a stream has been assigned and the head written; write the payload with
+       `cno_write_data(&req->conn->conn, req->stream, ...)`. Optional. */
+    int  (*on_sent         )(void *, struct cno_pool_request_t *);
+    /* The window of the stream or of the connection has grown. Optional. */
+    int  (*on_flow_increase)(void *, struct cno_pool_request_t *);
+    int  (*on_response     )(void *, const struct cno_message_t *);
+    int  (*on_data         )(void *, const char *, size_t);
+    /* Called exactly once, after the whole response has been received (`complete` = 1) or
+       when the request has failed or been cancelled (0). The request can be freed here. */
+    void (*on_close        )(void *, int complete);
+
+    /* Set by the pool once the request has been sent, NULL while it's queued. */
+    struct cno_pool_conn_t *conn;
+    uint32_t stream;
+
+    /* Private. */
+    struct cno_pool_request_t *next;
+    uint8_t flags;
+};
+
+
+/* A connection owned by a pool. `conn.cb_data` and all of its callbacks are taken. */
+struct cno_pool_conn_t
+{
+    struct cno_pool_conn_t *next;
+    struct cno_connection_t conn;
+    struct cno_pool_t *pool;
+    struct cno_pool_request_t *requests;  // sent, but not closed yet
+    void *data;  // for the application, e.g. the transport
+    int state;
+};
+
+
+/* HTTP 2 connections to a single origin. Each request goes to the open connection with
+ * the fewest streams in use among those below the peer's SETTINGS_MAX_CONCURRENT_STREAMS;
+ * if there is none, it waits in a queue, and a new connection is opened unless one is
+ * already being opened or there are `max_connections`. A connection that receives a
+ * GOAWAY gets no more requests and is closed once the ones it has accepted complete.
+ *
+ * Requests that the server has not processed (refused with REFUSED_STREAM, or above the
+ * last stream id in a GOAWAY) are queued again if they are safe (GET, HEAD, OPTIONS) and
+ * have no payload; the rest fail. If a connection fails before it is established, all
+ * queued requests fail with it, unless there are other open connections.
+ *
+ * The pool does no I/O. For each connection it asks the application to open, the
+ * application reports back with `cno_pool_connected`, `cno_pool_data_received` and
+ * `cno_pool_lost`. None of these, nor `cno_pool_request`, may be called from inside
+ * a callback of the pool; `cno_pool_cancel` can. */
+struct cno_pool_t
+{
+    unsigned max_connections;  // 0 = 1
+    void *cb_data;
+    /* Start opening a transport for a new connection and return. Configure `c->conn`
+       (e.g. its allocator or settings) here. Return -1 with an error set on failure. */
+    int  (*on_connect)(void *, struct cno_pool_conn_t *);
+    int  (*on_write  )(void *, struct cno_pool_conn_t *, const char *, size_t);
+    /* Called before `c` is freed, be it because the pool does not need it anymore or
+       because of `cno_pool_lost`; close the transport if it's still open. */
+    void (*on_close  )(void *, struct cno_pool_conn_t *);
+
+    /* Private. */
+    struct cno_pool_conn_t *conns;
+    struct cno_pool_request_t *queue;
+    struct cno_pool_request_t *queue_last;
+};
+
+
+/* Fail all requests and close all connections. The pool can be used again afterwards. */
+void cno_pool_clear (struct cno_pool_t *);
+/* Send a request or queue it until a connection has room for it. */
+int  cno_pool_request (struct cno_pool_t *, struct cno_pool_request_t *);
+/* Reset the stream or take the request out of the queue, then call its `on_close`. */
+int  cno_pool_cancel (struct cno_pool_t *, struct cno_pool_request_t *);
+
+/* The transport of a connection opened by `on_connect` is now ready for HTTP 2. The
+   connection is used once the server's SETTINGS have been received. If this fails,
+   the connection has been closed. */
+int  cno_pool_connected     (struct cno_pool_conn_t *);
+/* Pass data read from the transport. If this fails, the connection has been closed. */
+int  cno_pool_data_received (struct cno_pool_conn_t *, const char *, size_t);
+/* The transport has been closed or could not be opened. Frees the connection. */
+void cno_pool_lost          (struct cno_pool_conn_t *);
+
+#if __cplusplus
+}
+#endif
@@ -0,0 +1,68 @@
+#include "relay.h"
+
+
+void cno_relay_init(struct cno_relay_t *relay, struct cno_connection_t *src, uint32_t src_stream,
+                                               struct cno_connection_t *dst, uint32_t dst_stream)
+{
+    *relay = (struct cno_relay_t) { src, dst, src_stream, dst_stream, CNO_BUFFER_DYN_EMPTY, 0 };
+    relay->buffer.allocator = src->allocator;
+    src->flags |= CNO_CONN_FLAG_MANUAL_FLOW_CONTROL;
+}
+
+
+void cno_relay_clear(struct cno_relay_t *relay)
+{
+    cno_buffer_dyn_clear(&relay->buffer);
+}
+
+
+int cno_relay_data(struct cno_relay_t *relay, const char *data, size_t length)
+{
+    // whatever is already buffered has to go first.
+    if (relay->buffer.size)
+        return cno_buffer_dyn_concat(&relay->buffer, (struct cno_buffer_t) { data, length });
+
+    int sent = cno_write_data(relay->dst, relay->dst_stream, data, length, 0);
+    if (sent < 0)
+        return CNO_ERROR_UP();
+
+    if ((size_t) sent < length && cno_buffer_dyn_concat(&relay->buffer, (struct cno_buffer_t) { data + sent, length - sent }))
+        return CNO_ERROR_UP();
+
+    return cno_increase_flow_window(relay->src, relay->src_stream, sent);
+}
+
+
+int cno_relay_end(struct cno_relay_t *relay)
+{
+    relay->final = 1;
+    return relay->buffer.size ? CNO_OK : cno_relay_flush(relay);
+}
+
+
+int cno_relay_flush(struct cno_relay_t *relay)
+{
+    // final = 2: the end of the message has been written.
+    if (relay->final == 2 || (!relay->buffer.size && !relay->final))
+        return CNO_OK;
+
+    // writing the end of the message may fire `on_stream_end`, which may free the relay,
+    // so take the buffer out and assume that it will be written completely.
+    struct cno_buffer_dyn_t buffer = relay->buffer;
+    int final = relay->final;
+    relay->buffer = CNO_BUFFER_DYN_EMPTY;
+    relay->buffer.allocator = buffer.allocator;
+    relay->final = final ? 2 : 0;
+
+    int sent = cno_write_data(relay->dst, relay->dst_stream, buffer.data, buffer.size, final);
+    if (sent < 0 || (final && (size_t) sent == buffer.size)) {
+        cno_buffer_dyn_clear(&buffer);
+        return sent < 0 ? CNO_ERROR_UP() : CNO_OK;
+    }
+
+    cno_buffer_dyn_shift(&buffer, sent);
+    relay->buffer = buffer;
+    relay->final = final;
+    // once `src` has sent everything, there is no point in opening its window.
+    return final ? CNO_OK : cno_increase_flow_window(relay->src, relay->src_stream, sent);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "core.h"
+
+#if __cplusplus
+extern "C" {
+#endif
+
+
+/* Forwarding a message body from a stream of one connection to a stream of another,
+ * e.g. from a client to a backend in a reverse proxy. Each direction needs its own relay.
+ *
+ *  (src.on_message_start) -- relay the head with cno_write_message(dst, ..., final = 0), then
+ *      cno_relay_init(relay, src, src_stream, dst, dst_stream)
+ *  (src.on_message_data)  -- cno_relay_data(relay, data, length)
+ *  (src.on_message_end)   -- cno_relay_end(relay)
+ *  (dst.on_flow_increase) -- cno_relay_flush(relay) for the stream, or all relays if it's 0
+ *  (either on_stream_end) -- cno_relay_clear(relay), then reset the other stream if needed
+ *
+ * Data is written to `dst` straight from the buffer passed to `on_message_data`. Only
+ * what does not fit into the flow control window of `dst` is copied, and `src` is only
+ * told that it may send more (with a WINDOW_UPDATE for the stream) once the same amount
+ * has been written to `dst`, so at most one stream window worth of data is buffered.
+ * For that, `src` is switched to CNO_CONN_FLAG_MANUAL_FLOW_CONTROL: streams on it that
+ * are not relayed must open their windows with `cno_increase_flow_window` themselves.
+ *
+ * Either connection can be HTTP/1.x or HTTP 2. Since HTTP/1.x has no flow control, an
+ * HTTP/1.x `src` can overfill `buffer`; stop reading from it while `buffer.size` is large.
+ *
+ * The last write to `dst` may fire its `on_stream_end`, which may in turn clear or free
+ * the relay; none of these functions access the relay after that. */
+struct cno_relay_t
+{
+    struct cno_connection_t *src;
+    struct cno_connection_t *dst;
+    uint32_t src_stream;
+    uint32_t dst_stream;
+    struct cno_buffer_dyn_t buffer;  // received from `src`, but not yet written to `dst`
+    int final;  // set by `cno_relay_end`
+};
+
+
+void cno_relay_init  (struct cno_relay_t *, struct cno_connection_t *src, uint32_t src_stream,
+                                            struct cno_connection_t *dst, uint32_t dst_stream);
+/* Free the buffer. The streams are not affected. */
+void cno_relay_clear (struct cno_relay_t *);
+/* Write as much as the window of `dst` allows, buffer the rest. */
+int  cno_relay_data  (struct cno_relay_t *, const char *, size_t);
+/* Close the stream on `dst` once the buffer is empty. */
+int  cno_relay_end   (struct cno_relay_t *);
+/* Write what has been buffered; call when the window of `dst` opens. */
+int  cno_relay_flush (struct cno_relay_t *);
+
+#if __cplusplus
+}
+#endif
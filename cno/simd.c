@@ -0,0 +1,215 @@
+#include "config.h"
+#include "common.h"
+
+#if (__x86_64__ || __i386__) && __SSE2__
+#define CNO_SIMD_SSE2 1
+#include <immintrin.h>
+#elif __aarch64__ && __ARM_NEON
+#define CNO_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+/* every routine here processes whole blocks with vector instructions, then hands
+   the tail (or the whole thing, if it is shorter than a block) to the scalar version.
+   header names are usually short, so the scalar version must not be too dumb either. */
+struct cno_simd_t
+{
+    void (*lowercase)     (char *, size_t);
+    int  (*has_uppercase) (const char *, size_t);
+    int  (*has_forbidden) (const char *, size_t);
+};
+
+
+static inline int cno_is_upper(char c)
+{
+    return (uint8_t) (c - 'A') < 26;
+}
+
+
+static inline int cno_is_forbidden(char c)
+{
+    return c == '\0' || c == '\r' || c == '\n';
+}
+
+
+static void cno_lowercase_scalar(char *p, size_t n)
+{
+    for (; n--; p++)
+        *p |= cno_is_upper(*p) << 5;
+}
+
+
+static int cno_has_uppercase_scalar(const char *p, size_t n)
+{
+    for (; n--; p++)
+        if (cno_is_upper(*p))
+            return 1;
+    return 0;
+}
+
+
+static int cno_has_forbidden_scalar(const char *p, size_t n)
+{
+    for (; n--; p++)
+        if (cno_is_forbidden(*p))
+            return 1;
+    return 0;
+}
+
+
+#if CNO_SIMD_SSE2
+// no unsigned byte comparisons in SSE2, so shift 'A' to -128 and compare as signed.
+#define SSE2_UPPER(v) _mm_cmpgt_epi8(_mm_set1_epi8(-128 + 26), _mm_add_epi8(v, _mm_set1_epi8(128 - 'A')))
+#define SSE2_FORBIDDEN(v) _mm_or_si128(_mm_or_si128(        \
+    _mm_cmpeq_epi8(v, _mm_setzero_si128()),                 \
+    _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))),                \
+    _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')))
+
+
+static void cno_lowercase_sse2(char *p, size_t n)
+{
+    for (; n >= 16; n -= 16, p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        v = _mm_or_si128(v, _mm_and_si128(SSE2_UPPER(v), _mm_set1_epi8(0x20)));
+        _mm_storeu_si128((__m128i *) p, v);
+    }
+    cno_lowercase_scalar(p, n);
+}
+
+
+static int cno_has_uppercase_sse2(const char *p, size_t n)
+{
+    for (; n >= 16; n -= 16, p += 16)
+        if (_mm_movemask_epi8(SSE2_UPPER(_mm_loadu_si128((const __m128i *) p))))
+            return 1;
+    return cno_has_uppercase_scalar(p, n);
+}
+
+
+static int cno_has_forbidden_sse2(const char *p, size_t n)
+{
+    for (; n >= 16; n -= 16, p += 16)
+        if (_mm_movemask_epi8(SSE2_FORBIDDEN(_mm_loadu_si128((const __m128i *) p))))
+            return 1;
+    return cno_has_forbidden_scalar(p, n);
+}
+
+
+#define AVX2_UPPER(v) _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), _mm256_add_epi8(v, _mm256_set1_epi8(128 - 'A')))
+#define AVX2_FORBIDDEN(v) _mm256_or_si256(_mm256_or_si256(  \
+    _mm256_cmpeq_epi8(v, _mm256_setzero_si256()),           \
+    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))),          \
+    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')))
+
+
+__attribute__((target("avx2")))
+static void cno_lowercase_avx2(char *p, size_t n)
+{
+    for (; n >= 32; n -= 32, p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        v = _mm256_or_si256(v, _mm256_and_si256(AVX2_UPPER(v), _mm256_set1_epi8(0x20)));
+        _mm256_storeu_si256((__m256i *) p, v);
+    }
+    cno_lowercase_sse2(p, n);
+}
+
+
+__attribute__((target("avx2")))
+static int cno_has_uppercase_avx2(const char *p, size_t n)
+{
+    for (; n >= 32; n -= 32, p += 32)
+        if (_mm256_movemask_epi8(AVX2_UPPER(_mm256_loadu_si256((const __m256i *) p))))
+            return 1;
+    return cno_has_uppercase_sse2(p, n);
+}
+
+
+__attribute__((target("avx2")))
+static int cno_has_forbidden_avx2(const char *p, size_t n)
+{
+    for (; n >= 32; n -= 32, p += 32)
+        if (_mm256_movemask_epi8(AVX2_FORBIDDEN(_mm256_loadu_si256((const __m256i *) p))))
+            return 1;
+    return cno_has_forbidden_sse2(p, n);
+}
+#endif
+
+
+#if CNO_SIMD_NEON
+#define NEON_UPPER(v) vcltq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8(26))
+#define NEON_FORBIDDEN(v) vorrq_u8(vorrq_u8( \
+    vceqq_u8(v, vdupq_n_u8(0)),              \
+    vceqq_u8(v, vdupq_n_u8('\r'))),          \
+    vceqq_u8(v, vdupq_n_u8('\n')))
+
+
+static void cno_lowercase_neon(char *p, size_t n)
+{
+    for (; n >= 16; n -= 16, p += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *) p);
+        vst1q_u8((uint8_t *) p, vorrq_u8(v, vandq_u8(NEON_UPPER(v), vdupq_n_u8(0x20))));
+    }
+    cno_lowercase_scalar(p, n);
+}
+
+
+static int cno_has_uppercase_neon(const char *p, size_t n)
+{
+    for (; n >= 16; n -= 16, p += 16)
+        if (vmaxvq_u8(NEON_UPPER(vld1q_u8((const uint8_t *) p))))
+            return 1;
+    return cno_has_uppercase_scalar(p, n);
+}
+
+
+static int cno_has_forbidden_neon(const char *p, size_t n)
+{
+    for (; n >= 16; n -= 16, p += 16)
+        if (vmaxvq_u8(NEON_FORBIDDEN(vld1q_u8((const uint8_t *) p))))
+            return 1;
+    return cno_has_forbidden_scalar(p, n);
+}
+#endif
+
+
+static struct cno_simd_t CNO_SIMD = {
+#if CNO_SIMD_SSE2
+    &cno_lowercase_sse2, &cno_has_uppercase_sse2, &cno_has_forbidden_sse2,
+#elif CNO_SIMD_NEON
+    &cno_lowercase_neon, &cno_has_uppercase_neon, &cno_has_forbidden_neon,
+#else
+    &cno_lowercase_scalar, &cno_has_uppercase_scalar, &cno_has_forbidden_scalar,
+#endif
+};
+
+
+/* SSE2 and NEON are part of the base instruction set on their respective platforms;
+   AVX2 is not, so it is only enabled if the CPU we're running on actually has it. */
+__attribute__((constructor))
+static void cno_simd_select(void)
+{
+#if CNO_SIMD_SSE2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        CNO_SIMD = (struct cno_simd_t) { &cno_lowercase_avx2, &cno_has_uppercase_avx2, &cno_has_forbidden_avx2 };
+#endif
+}
+
+
+void cno_header_name_lowercase(char *data, size_t size)
+{
+    CNO_SIMD.lowercase(data, size);
+}
+
+
+int cno_header_name_has_uppercase(const struct cno_buffer_t name)
+{
+    return CNO_SIMD.has_uppercase(name.data, name.size);
+}
+
+
+int cno_header_value_is_invalid(const struct cno_buffer_t value)
+{
+    return CNO_SIMD.has_forbidden(value.data, value.size);
+}
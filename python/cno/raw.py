@@ -113,6 +113,17 @@ class Connection:
     def data_received(self, data):
         self.__throw(cno_connection_data_received(self.__c, data, len(data)))
 
+    def data_received_partial(self, data):
+        consumed = ffi.new('size_t *')
+        self.__throw(cno_connection_data_received_partial(self.__c, data, len(data), consumed))
+        return consumed[0]
+
+    def pause(self):
+        cno_connection_pause(self.__c)
+
+    def resume(self):
+        self.__throw(cno_connection_resume(self.__c))
+
     def write_message(self, i, code, method, path, headers, is_final):
         msg, refs = _msgpack(code, method, path, headers)
         self.__throw(cno_write_message(self.__c, i, msg, is_final))